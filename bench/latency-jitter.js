@@ -0,0 +1,84 @@
+// Measures completion latency of small interrupt/bulk reads on the test
+// device, with and without event thread scheduling.
+//
+//   node bench/latency-jitter.js [count] [--fifo=priority] [--nice=n] [--cpus=0,1]
+//
+// The GC churn loop keeps V8 helper threads busy, as a loaded service would.
+
+var usb = require('../usb')
+
+var count = 2000
+var sched = {}
+process.argv.slice(2).forEach(function(arg){
+	var m = /^--(\w+)=(.*)$/.exec(arg)
+	if (!m){
+		count = parseInt(arg, 10)
+	}else if (m[1] == 'fifo'){
+		sched.policy = 'fifo'
+		sched.priority = parseInt(m[2], 10)
+	}else if (m[1] == 'nice'){
+		sched.nice = parseInt(m[2], 10)
+	}else if (m[1] == 'cpus'){
+		sched.cpus = m[2].split(',').map(Number)
+	}
+})
+
+if (Object.keys(sched).length){
+	usb.setEventThreadScheduling(sched)
+}
+
+var device = usb.findByIds(0x59e3, 0x0a23)
+if (!device){
+	console.error("Test device not found")
+	process.exit(1)
+}
+device.open()
+var iface = device.interface(0)
+iface.claim()
+var inEndpoint = iface.endpoints[0]
+
+var churn = setInterval(function(){
+	var garbage = []
+	for (var i = 0; i < 10000; i++) garbage.push({i: i})
+}, 1)
+
+var samples = []
+var buffer = new Buffer(64)
+var t = inEndpoint.makeTransfer(1000, function(error, buf, actual){
+	var elapsed = process.hrtime(start)
+	if (error) throw error
+	samples.push(elapsed[0] * 1e6 + elapsed[1] / 1e3)
+	if (samples.length < count){
+		submit()
+	}else{
+		done()
+	}
+})
+t.prepare(buffer)
+
+var start
+function submit(){
+	start = process.hrtime()
+	t.submit()
+}
+
+function percentile(sorted, p){
+	return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))]
+}
+
+function done(){
+	clearInterval(churn)
+	t.unprepare()
+	iface.release(function(){
+		device.close()
+	})
+
+	samples.sort(function(a, b){ return a - b })
+	console.log("scheduling: " + JSON.stringify(sched))
+	;[0.5, 0.9, 0.99, 0.999].forEach(function(p){
+		console.log("p" + (p * 100) + ": " + percentile(samples, p).toFixed(1) + " us")
+	})
+	console.log("max: " + samples[samples.length - 1].toFixed(1) + " us")
+}
+
+submit()
@@ -21,6 +21,9 @@
         './src/node_usb.cc',
         './src/device.cc',
         './src/transfer.cc',
+        './src/framer.cc',
+        './src/poller.cc',
+        './src/work_pool.cc',
       ],
       'cflags_cc': [
         '-std=c++0x'
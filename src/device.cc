@@ -1,5 +1,6 @@
 #include "node_usb.h"
 #include <string.h>
+#include <algorithm>
 
 #define STRUCT_TO_V8(TARGET, STR, NAME) \
 		TARGET->ForceSet(V8STR(#NAME), NanNew<Uint32>((uint32_t) (STR).NAME), CONST_PROP);
@@ -15,8 +16,14 @@ Handle<Object> makeBuffer(const unsigned char* ptr, unsigned length) {
 	return NanNewBufferHandle((char*) ptr, (uint32_t) length);
 }
 
-Device::Device(libusb_device* d): device(d), device_handle(0) {
+Device::Device(libusb_device* d, const libusb_device_descriptor* dd): device(d), device_handle(0),
+		haveDescriptor(false), inflightBytes(0), maxInflightBytes(0), maxQueuedBytes(0), deferredBytes(0) {
 	libusb_ref_device(device);
+	uv_mutex_init(&activeLock);
+	if (dd){
+		descriptor = *dd;
+		haveDescriptor = true;
+	}
 	DEBUG_LOG("Created device %p", this);
 }
 
@@ -25,6 +32,7 @@ Device::~Device(){
 	DEBUG_LOG("Freed device %p", this);
 	libusb_close(device_handle);
 	libusb_unref_device(device);
+	uv_mutex_destroy(&activeLock);
 }
 
 // Map pinning each libusb_device to a particular V8 instance
@@ -35,14 +43,15 @@ NAN_WEAK_CALLBACK(DeviceWeakCallback) {
 }
 
 // Get a V8 instance for a libusb_device: either the existing one from the map,
-// or create a new one and add it to the map.
-Handle<Value> Device::get(libusb_device* dev){
+// or create a new one and add it to the map. The device descriptor can be
+// passed in if it was already read off the main thread.
+Handle<Value> Device::get(libusb_device* dev, const libusb_device_descriptor* descriptor){
 	auto it = byPtr.find(dev);
 	if (it != byPtr.end()){
 		return NanNew(it->second->persistent);
 	}else{
 		Local<FunctionTemplate> constructorHandle = NanNew<v8::FunctionTemplate>(device_constructor);
-		v8::Handle<v8::Value> argv[1] = { EXTERNAL_NEW(new Device(dev)) };
+		v8::Handle<v8::Value> argv[1] = { EXTERNAL_NEW(new Device(dev, descriptor)) };
 		Handle<Value> v = constructorHandle->GetFunction()->NewInstance(1, argv);
 		auto p = NanMakeWeakPersistent(v, dev, DeviceWeakCallback);
 		byPtr.insert(std::make_pair(dev, p));
@@ -66,8 +75,11 @@ static NAN_METHOD(deviceConstructor) {
 	Local<Object> v8dd = NanNew<Object>();
 	args.This()->ForceSet(V8SYM("deviceDescriptor"), v8dd, CONST_PROP);
 
-	struct libusb_device_descriptor dd;
-	CHECK_USB(libusb_get_device_descriptor(self->device, &dd));
+	if (!self->haveDescriptor){
+		CHECK_USB(libusb_get_device_descriptor(self->device, &self->descriptor));
+		self->haveDescriptor = true;
+	}
+	const libusb_device_descriptor& dd = self->descriptor;
 
 	STRUCT_TO_V8(v8dd, dd, bLength)
 	STRUCT_TO_V8(v8dd, dd, bDescriptorType)
@@ -171,14 +183,6 @@ NAN_METHOD(Device_GetConfigDescriptor) {
 	NanReturnValue(v8cdesc);
 }
 
-NAN_METHOD(Device_Open) {
-	ENTER_METHOD(Device, 0);
-	if (!self->device_handle){
-		CHECK_USB(libusb_open(self->device, &self->device_handle));
-	}
-	NanReturnValue(NanUndefined());
-}
-
 NAN_METHOD(Device_Close) {
 	ENTER_METHOD(Device, 0);
 	if (self->canClose()){
@@ -190,6 +194,119 @@ NAN_METHOD(Device_Close) {
 	NanReturnValue(NanUndefined());
 }
 
+// Blocking transfers for callers that would rather wait than pay for the trip
+// through the libusb event thread and back to the event loop.
+
+// __transferSync(endpointAddr, type, buffer, timeout) -> bytes transferred
+NAN_METHOD(Device_TransferSync) {
+	ENTER_METHOD(Device, 4);
+	CHECK_OPEN();
+	int endpoint, type, timeout;
+	INT_ARG(endpoint, 0);
+	INT_ARG(type, 1);
+	if (!Buffer::HasInstance(args[2])){
+		THROW_BAD_ARGS("Buffer arg [2] must be Buffer");
+	}
+	INT_ARG(timeout, 3);
+	if (timeout <= 0){
+		THROW_BAD_ARGS("Synchronous transfers require a non-zero timeout");
+	}
+
+	Local<Object> buffer_obj = args[2]->ToObject();
+	unsigned char* data = (unsigned char*) Buffer::Data(buffer_obj);
+	int length = Buffer::Length(buffer_obj);
+	int actual = 0;
+	int r;
+
+	if (type == LIBUSB_TRANSFER_TYPE_BULK){
+		r = libusb_bulk_transfer(self->device_handle, endpoint, data, length, &actual, timeout);
+	}else if (type == LIBUSB_TRANSFER_TYPE_INTERRUPT){
+		r = libusb_interrupt_transfer(self->device_handle, endpoint, data, length, &actual, timeout);
+	}else{
+		THROW_BAD_ARGS("Synchronous transfers require a bulk or interrupt endpoint");
+	}
+
+	if (r < LIBUSB_SUCCESS){
+		// A timeout can still have moved part of the buffer; don't lose it.
+		Local<Object> error = libusbException(r)->ToObject();
+		error->Set(V8SYM("actual"), NanNew<Uint32>((uint32_t) actual));
+		return NanThrowError(error);
+	}
+	NanReturnValue(NanNew<Uint32>((uint32_t) actual));
+}
+
+// __controlTransferSync(bmRequestType, bRequest, wValue, wIndex, buffer, timeout) -> bytes transferred
+NAN_METHOD(Device_ControlTransferSync) {
+	ENTER_METHOD(Device, 6);
+	CHECK_OPEN();
+	int bmRequestType, bRequest, wValue, wIndex, timeout;
+	INT_ARG(bmRequestType, 0);
+	INT_ARG(bRequest, 1);
+	INT_ARG(wValue, 2);
+	INT_ARG(wIndex, 3);
+	if (!Buffer::HasInstance(args[4])){
+		THROW_BAD_ARGS("Buffer arg [4] must be Buffer");
+	}
+	INT_ARG(timeout, 5);
+	if (timeout <= 0){
+		THROW_BAD_ARGS("Synchronous transfers require a non-zero timeout");
+	}
+
+	Local<Object> buffer_obj = args[4]->ToObject();
+	if (Buffer::Length(buffer_obj) > 0xffff){
+		THROW_BAD_ARGS("Control transfers are limited to 65535 bytes");
+	}
+
+	int r = libusb_control_transfer(self->device_handle, bmRequestType, bRequest, wValue, wIndex,
+		(unsigned char*) Buffer::Data(buffer_obj), Buffer::Length(buffer_obj), timeout);
+	CHECK_USB(r);
+	NanReturnValue(NanNew<Uint32>((uint32_t) r));
+}
+
+// __getInflightBytes([endpointAddr])
+NAN_METHOD(Device_GetInflightBytes) {
+	ENTER_METHOD(Device, 0);
+	if (args.Length() > 0){
+		int endpoint;
+		INT_ARG(endpoint, 0);
+		auto it = self->inflightByEndpoint.find(endpoint);
+		size_t bytes = it == self->inflightByEndpoint.end() ? 0 : it->second;
+		NanReturnValue(NanNew<Number>((double) bytes));
+	}
+	NanReturnValue(NanNew<Number>((double) self->inflightBytes));
+}
+
+// __getQueuedBytes() -> bytes held by transfers deferred by maxInflightBytes
+NAN_METHOD(Device_GetQueuedBytes) {
+	ENTER_METHOD(Device, 0);
+	NanReturnValue(NanNew<Number>((double) self->deferredBytes));
+}
+
+// __setMaxInflightBytes(bytes): 0 for no limit
+NAN_METHOD(Device_SetMaxInflightBytes) {
+	ENTER_METHOD(Device, 1);
+	double bytes;
+	DOUBLE_ARG(bytes, 0);
+	if (bytes < 0){
+		THROW_BAD_ARGS("Limit must not be negative");
+	}
+	self->maxInflightBytes = (size_t) bytes;
+	self->submitDeferred();
+	NanReturnValue(NanUndefined());
+}
+
+// __setMaxQueuedBytes(bytes): 0 to follow maxInflightBytes
+NAN_METHOD(Device_SetMaxQueuedBytes) {
+	ENTER_METHOD(Device, 1);
+	double bytes;
+	DOUBLE_ARG(bytes, 0);
+	if (bytes < 0){
+		THROW_BAD_ARGS("Limit must not be negative");
+	}
+	self->maxQueuedBytes = (size_t) bytes;
+	NanReturnValue(NanUndefined());
+}
+
 struct Req{
 	uv_work_t req;
 	Device* device;
@@ -201,7 +318,7 @@ struct Req{
 		device = d;
 		device->ref();
 		req.data = this;
-		uv_queue_work(uv_default_loop(), &req, backend, (uv_after_work_cb) after);
+		WorkPool::queue(&req, backend, (uv_after_work_cb) after);
 	}
 
 	static void default_after(uv_work_t *req){
@@ -228,6 +345,43 @@ struct Req{
 	}
 };
 
+struct Device_Open: Req{
+	libusb_device_handle* handle;
+
+	static NAN_METHOD(begin) {
+		ENTER_METHOD(Device, 0);
+		CALLBACK_ARG(0);
+		if (callback.IsEmpty()){
+			if (!self->device_handle){
+				CHECK_USB(libusb_open(self->device, &self->device_handle));
+			}
+			NanReturnValue(NanUndefined());
+		}
+		auto baton = new Device_Open;
+		baton->handle = NULL;
+		baton->submit(self, callback, &backend, &after);
+		NanReturnValue(NanUndefined());
+	}
+
+	static void backend(uv_work_t *req){
+		auto baton = (Device_Open*) req->data;
+		baton->errcode = libusb_open(baton->device->device, &baton->handle);
+	}
+
+	static void after(uv_work_t *req){
+		auto baton = (Device_Open*) req->data;
+		if (baton->errcode == LIBUSB_SUCCESS){
+			if (baton->device->device_handle){
+				// Opened synchronously in the meantime
+				libusb_close(baton->handle);
+			}else{
+				baton->device->device_handle = baton->handle;
+			}
+		}
+		default_after(req);
+	}
+};
+
 struct Device_Reset: Req{
 	static NAN_METHOD(begin) {
 		ENTER_METHOD(Device, 0);
@@ -254,32 +408,80 @@ NAN_METHOD(IsKernelDriverActive) {
 	NanReturnValue(NanNew<Boolean>(r));
 }
 
-NAN_METHOD(DetachKernelDriver) {
-	ENTER_METHOD(Device, 1);
-	CHECK_OPEN();
+struct DetachKernelDriver: Req{
 	int interface;
-	INT_ARG(interface, 0);
-	CHECK_USB(libusb_detach_kernel_driver(self->device_handle, interface));
-	NanReturnValue(NanUndefined());
-}
 
-NAN_METHOD(AttachKernelDriver) {
-	ENTER_METHOD(Device, 1);
-	CHECK_OPEN();
+	static NAN_METHOD(begin){
+		ENTER_METHOD(Device, 1);
+		CHECK_OPEN();
+		int interface;
+		INT_ARG(interface, 0);
+		CALLBACK_ARG(1);
+		if (callback.IsEmpty()){
+			CHECK_USB(libusb_detach_kernel_driver(self->device_handle, interface));
+			NanReturnValue(NanUndefined());
+		}
+		auto baton = new DetachKernelDriver;
+		baton->interface = interface;
+		baton->submit(self, callback, &backend, &default_after);
+		NanReturnValue(NanUndefined());
+	}
+
+	static void backend(uv_work_t *req){
+		auto baton = (DetachKernelDriver*) req->data;
+		baton->errcode = libusb_detach_kernel_driver(baton->device->device_handle, baton->interface);
+	}
+};
+
+struct AttachKernelDriver: Req{
 	int interface;
-	INT_ARG(interface, 0);
-	CHECK_USB(libusb_attach_kernel_driver(self->device_handle, interface));
-	NanReturnValue(NanUndefined());
-}
 
-NAN_METHOD(Device_ClaimInterface) {
-	ENTER_METHOD(Device, 1);
-	CHECK_OPEN();
+	static NAN_METHOD(begin){
+		ENTER_METHOD(Device, 1);
+		CHECK_OPEN();
+		int interface;
+		INT_ARG(interface, 0);
+		CALLBACK_ARG(1);
+		if (callback.IsEmpty()){
+			CHECK_USB(libusb_attach_kernel_driver(self->device_handle, interface));
+			NanReturnValue(NanUndefined());
+		}
+		auto baton = new AttachKernelDriver;
+		baton->interface = interface;
+		baton->submit(self, callback, &backend, &default_after);
+		NanReturnValue(NanUndefined());
+	}
+
+	static void backend(uv_work_t *req){
+		auto baton = (AttachKernelDriver*) req->data;
+		baton->errcode = libusb_attach_kernel_driver(baton->device->device_handle, baton->interface);
+	}
+};
+
+struct Device_ClaimInterface: Req{
 	int interface;
-	INT_ARG(interface, 0);
-	CHECK_USB(libusb_claim_interface(self->device_handle, interface));
-	NanReturnValue(NanUndefined());
-}
+
+	static NAN_METHOD(begin){
+		ENTER_METHOD(Device, 1);
+		CHECK_OPEN();
+		int interface;
+		INT_ARG(interface, 0);
+		CALLBACK_ARG(1);
+		if (callback.IsEmpty()){
+			CHECK_USB(libusb_claim_interface(self->device_handle, interface));
+			NanReturnValue(NanUndefined());
+		}
+		auto baton = new Device_ClaimInterface;
+		baton->interface = interface;
+		baton->submit(self, callback, &backend, &default_after);
+		NanReturnValue(NanUndefined());
+	}
+
+	static void backend(uv_work_t *req){
+		auto baton = (Device_ClaimInterface*) req->data;
+		baton->errcode = libusb_claim_interface(baton->device->device_handle, baton->interface);
+	}
+};
 
 struct Device_ReleaseInterface: Req{
 	int interface;
@@ -328,23 +530,164 @@ struct Device_SetInterface: Req{
 	}
 };
 
+// Bring a re-enumerated device back to the state recorded for it: open it,
+// check its serial number, detach the kernel drivers that had been detached
+// (they bind again on re-enumeration, and claiming would fail with
+// LIBUSB_ERROR_BUSY), claim interfaces and select alternate settings, all in
+// a single trip to a worker thread.
+struct Device_Restore: Req{
+	libusb_device_handle* handle;
+	bool checkSerial;
+	std::vector<unsigned char> serial;
+	std::vector<int> interfaces;
+	std::vector<int> altSettings;
+	std::vector<int> detach;
+
+	// __restore(serial | null, interfaces, altSettings, detachInterfaces, callback(error))
+	// serial is the expected string descriptor as a UTF-16LE Buffer.
+	static NAN_METHOD(begin){
+		ENTER_METHOD(Device, 5);
+		if (self->device_handle){
+			THROW_ERROR("Device is already open");
+		}
+		bool checkSerial = !args[0]->IsNull() && !args[0]->IsUndefined();
+		if (checkSerial && !Buffer::HasInstance(args[0])){
+			THROW_BAD_ARGS("Serial arg [0] must be Buffer");
+		}
+		if (!args[1]->IsArray() || !args[2]->IsArray() || !args[3]->IsArray()){
+			THROW_BAD_ARGS("Interfaces, alt settings and detached interfaces must be arrays");
+		}
+		CALLBACK_ARG(4);
+
+		auto baton = new Device_Restore;
+		baton->handle = NULL;
+		baton->checkSerial = checkSerial;
+		if (checkSerial){
+			Local<Object> buffer_obj = args[0]->ToObject();
+			unsigned char* data = (unsigned char*) Buffer::Data(buffer_obj);
+			baton->serial.assign(data, data + Buffer::Length(buffer_obj));
+		}
+		Local<Array> interfaces = Local<Array>::Cast(args[1]);
+		Local<Array> altSettings = Local<Array>::Cast(args[2]);
+		for (uint32_t i = 0; i < interfaces->Length(); i++){
+			baton->interfaces.push_back(interfaces->Get(i)->Int32Value());
+			baton->altSettings.push_back(altSettings->Get(i)->Int32Value());
+		}
+		Local<Array> detach = Local<Array>::Cast(args[3]);
+		for (uint32_t i = 0; i < detach->Length(); i++){
+			baton->detach.push_back(detach->Get(i)->Int32Value());
+		}
+		baton->submit(self, callback, &backend, &after);
+		NanReturnValue(NanUndefined());
+	}
+
+	static void backend(uv_work_t *req){
+		auto baton = (Device_Restore*) req->data;
+		Device* device = baton->device;
+		int r = libusb_open(device->device, &baton->handle);
+		if (r < LIBUSB_SUCCESS){
+			baton->errcode = r;
+			return;
+		}
+
+		size_t claimed = 0, detached = 0;
+		std::vector<int> reattach;
+		if (baton->checkSerial){
+			unsigned char buf[256];
+			r = LIBUSB_ERROR_NOT_FOUND;
+			if (device->descriptor.iSerialNumber){
+				r = libusb_get_string_descriptor(baton->handle, device->descriptor.iSerialNumber,
+					0x0409, buf, sizeof(buf));
+			}
+			if (r >= LIBUSB_SUCCESS){
+				// Skip bLength and bDescriptorType
+				bool match = r >= 2 && baton->serial.size() == (size_t) (r - 2)
+					&& std::equal(baton->serial.begin(), baton->serial.end(), buf + 2);
+				r = match ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+			}
+			if (r < LIBUSB_SUCCESS) goto fail;
+		}
+
+		for (; detached < baton->detach.size(); detached++){
+			int iface = baton->detach[detached];
+			r = libusb_kernel_driver_active(baton->handle, iface);
+			if (r == 1){
+				r = libusb_detach_kernel_driver(baton->handle, iface);
+				if (r < LIBUSB_SUCCESS) goto fail;
+				reattach.push_back(iface);
+			}else if (r < LIBUSB_SUCCESS && r != LIBUSB_ERROR_NOT_SUPPORTED){
+				goto fail;
+			}
+		}
+
+		for (; claimed < baton->interfaces.size(); claimed++){
+			r = libusb_claim_interface(baton->handle, baton->interfaces[claimed]);
+			if (r < LIBUSB_SUCCESS) goto fail;
+			if (baton->altSettings[claimed]){
+				r = libusb_set_interface_alt_setting(baton->handle,
+					baton->interfaces[claimed], baton->altSettings[claimed]);
+				if (r < LIBUSB_SUCCESS){
+					claimed++;
+					goto fail;
+				}
+			}
+		}
+		baton->errcode = LIBUSB_SUCCESS;
+		return;
+
+	fail:
+		while (claimed--){
+			libusb_release_interface(baton->handle, baton->interfaces[claimed]);
+		}
+		for (size_t i = 0; i < reattach.size(); i++){
+			libusb_attach_kernel_driver(baton->handle, reattach[i]);
+		}
+		libusb_close(baton->handle);
+		baton->handle = NULL;
+		baton->errcode = r;
+	}
+
+	static void after(uv_work_t *req){
+		auto baton = (Device_Restore*) req->data;
+		if (baton->handle){
+			if (baton->device->device_handle){
+				// Opened synchronously in the meantime
+				libusb_close(baton->handle);
+				baton->errcode = LIBUSB_ERROR_BUSY;
+			}else{
+				baton->device->device_handle = baton->handle;
+			}
+		}
+		default_after(req);
+	}
+};
+
 void Device::Init(Handle<Object> target){
 	Local<FunctionTemplate> tpl = NanNew<FunctionTemplate>(deviceConstructor);
 	tpl->SetClassName(NanNew("Device"));
 	tpl->InstanceTemplate()->SetInternalFieldCount(1);
 
 	NODE_SET_PROTOTYPE_METHOD(tpl, "__getConfigDescriptor", Device_GetConfigDescriptor);
-	NODE_SET_PROTOTYPE_METHOD(tpl, "__open", Device_Open);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__open", Device_Open::begin);
 	NODE_SET_PROTOTYPE_METHOD(tpl, "__close", Device_Close);
 	NODE_SET_PROTOTYPE_METHOD(tpl, "reset", Device_Reset::begin);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__restore", Device_Restore::begin);
+
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__getInflightBytes", Device_GetInflightBytes);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__setMaxInflightBytes", Device_SetMaxInflightBytes);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__getQueuedBytes", Device_GetQueuedBytes);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__setMaxQueuedBytes", Device_SetMaxQueuedBytes);
+
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__transferSync", Device_TransferSync);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__controlTransferSync", Device_ControlTransferSync);
 
-	NODE_SET_PROTOTYPE_METHOD(tpl, "__claimInterface", Device_ClaimInterface);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__claimInterface", Device_ClaimInterface::begin);
 	NODE_SET_PROTOTYPE_METHOD(tpl, "__releaseInterface", Device_ReleaseInterface::begin);
 	NODE_SET_PROTOTYPE_METHOD(tpl, "__setInterface", Device_SetInterface::begin);
 
 	NODE_SET_PROTOTYPE_METHOD(tpl, "__isKernelDriverActive", IsKernelDriverActive);
-	NODE_SET_PROTOTYPE_METHOD(tpl, "__detachKernelDriver", DetachKernelDriver);
-	NODE_SET_PROTOTYPE_METHOD(tpl, "__attachKernelDriver", AttachKernelDriver);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__detachKernelDriver", DetachKernelDriver::begin);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "__attachKernelDriver", AttachKernelDriver::begin);
 
 	NanAssignPersistent(device_constructor, tpl);
 	target->Set(NanNew("Device"), tpl->GetFunction());
@@ -0,0 +1,214 @@
+#include "node_usb.h"
+#include <algorithm>
+
+Framer::Framer(FramerKind k): kind(k), maxLength(0), headerOffset(0), headerSize(0),
+	bigEndian(false), lengthAdjust(0), recordSize(0), searchFrom(0), reportedBytes(0) {
+	DEBUG_LOG("Created Framer %p", this);
+}
+
+Framer::~Framer(){
+	DEBUG_LOG("Freed Framer %p", this);
+	NanAdjustExternalMemory(-(int) reportedBytes);
+}
+
+// Tell V8 how much memory the partial frame buffer holds, so a stalled
+// stream of large frames is visible to the GC.
+void Framer::reportMemory(){
+	size_t capacity = pending.capacity();
+	if (capacity != reportedBytes){
+		NanAdjustExternalMemory((int) capacity - (int) reportedBytes);
+		reportedBytes = capacity;
+	}
+}
+
+int Framer::nextFrame(const unsigned char* data, size_t length, size_t& frameLength, size_t& consumed){
+	switch (kind){
+		case FRAMER_LENGTH_PREFIXED: {
+			size_t headerEnd = headerOffset + headerSize;
+			if (length < headerEnd) return 0;
+
+			uint32_t value = 0;
+			for (unsigned i = 0; i < headerSize; i++){
+				unsigned shift = bigEndian ? (headerSize - 1 - i) : i;
+				value |= (uint32_t) data[headerOffset + i] << (8 * shift);
+			}
+
+			int64_t total = (int64_t) headerEnd + value + lengthAdjust;
+			if (total < (int64_t) headerEnd || (uint64_t) total > maxLength) return -1;
+			if (length < (size_t) total) return 0;
+			frameLength = consumed = (size_t) total;
+			return 1;
+		}
+
+		case FRAMER_DELIMITED: {
+			const unsigned char* end = data + length;
+			const unsigned char* found = std::search(data + searchFrom, end, delimiter.begin(), delimiter.end());
+			if (found == end){
+				// Even a delimiter starting right after maxLength bytes would be here
+				if (length >= maxLength + delimiter.size()) return -1;
+				// The delimiter may be split across reads, so rescan its length - 1 bytes
+				searchFrom = length >= delimiter.size() ? length - delimiter.size() + 1 : 0;
+				return 0;
+			}
+			frameLength = found - data;
+			if (frameLength > maxLength) return -1;
+			consumed = frameLength + delimiter.size();
+			searchFrom = 0;
+			return 1;
+		}
+
+		case FRAMER_FIXED_SIZE:
+			if (length < recordSize) return 0;
+			frameLength = consumed = recordSize;
+			return 1;
+	}
+	return -1;
+}
+
+// new Framer(kind, maxLength, ...)
+//   FRAMER_LENGTH_PREFIXED: headerOffset, headerSize, bigEndian, lengthAdjust
+//   FRAMER_DELIMITED: delimiter
+//   FRAMER_FIXED_SIZE: recordSize
+NAN_METHOD(Framer_constructor) {
+	ENTER_CONSTRUCTOR(2);
+	int kind, maxLength;
+	INT_ARG(kind, 0);
+	INT_ARG(maxLength, 1);
+	if (maxLength <= 0){
+		THROW_BAD_ARGS("maxLength must be positive");
+	}
+
+	// The argument macros return early, so everything is checked before the
+	// Framer is allocated
+	int headerOffset = 0, headerSize = 0, lengthAdjust = 0, recordSize = 0;
+	bool bigEndian = false;
+	switch (kind){
+		case FRAMER_LENGTH_PREFIXED:
+			CHECK_N_ARGS(6);
+			INT_ARG(headerOffset, 2);
+			INT_ARG(headerSize, 3);
+			BOOL_ARG(bigEndian, 4);
+			INT_ARG(lengthAdjust, 5);
+			if (headerOffset < 0 || (headerSize != 1 && headerSize != 2 && headerSize != 4)){
+				THROW_BAD_ARGS("Invalid length header layout");
+			}
+			break;
+
+		case FRAMER_DELIMITED:
+			CHECK_N_ARGS(3);
+			if (!Buffer::HasInstance(args[2]) || Buffer::Length(args[2]) == 0){
+				THROW_BAD_ARGS("Delimiter must be a non-empty Buffer");
+			}
+			break;
+
+		case FRAMER_FIXED_SIZE:
+			CHECK_N_ARGS(3);
+			INT_ARG(recordSize, 2);
+			if (recordSize <= 0){
+				THROW_BAD_ARGS("recordSize must be positive");
+			}
+			break;
+
+		default:
+			THROW_BAD_ARGS("Unknown framer type");
+	}
+
+	auto self = new Framer((FramerKind) kind);
+	self->maxLength = maxLength;
+	self->headerOffset = headerOffset;
+	self->headerSize = headerSize;
+	self->bigEndian = bigEndian;
+	self->lengthAdjust = lengthAdjust;
+	self->recordSize = recordSize;
+	if (kind == FRAMER_DELIMITED){
+		const unsigned char* delimiter = (const unsigned char*) Buffer::Data(args[2]);
+		self->delimiter.assign(delimiter, delimiter + Buffer::Length(args[2]));
+	}
+
+	self->attach(args.This());
+	NanReturnValue(args.This());
+}
+
+// Framer.push(buffer, [length]) -> Array of complete messages. On a bad
+// frame, throws an error whose messages are those completed before it.
+NAN_METHOD(Framer_Push) {
+	ENTER_METHOD(Framer, 1);
+
+	if (!Buffer::HasInstance(args[0])){
+		THROW_BAD_ARGS("Buffer arg [0] must be Buffer");
+	}
+	Local<Object> buffer_obj = args[0]->ToObject();
+	const unsigned char* data = (const unsigned char*) Buffer::Data(buffer_obj);
+	size_t length = Buffer::Length(buffer_obj);
+
+	if (args.Length() > 1){
+		int actual;
+		INT_ARG(actual, 1);
+		if (actual < 0 || (size_t) actual > length){
+			THROW_BAD_ARGS("Length arg [1] is out of range");
+		}
+		length = actual;
+	}
+
+	// Frames are cut directly out of the incoming data when nothing is
+	// buffered; only a trailing partial frame gets copied.
+	bool buffered = !self->pending.empty();
+	if (buffered){
+		self->pending.insert(self->pending.end(), data, data + length);
+		data = &self->pending[0];
+		length = self->pending.size();
+	}
+
+	Local<Array> messages = NanNew<Array>();
+	uint32_t count = 0;
+	size_t offset = 0;
+
+	while (offset < length){
+		size_t frameLength, consumed;
+		int r = self->nextFrame(data + offset, length - offset, frameLength, consumed);
+		if (r == 0) break;
+		if (r < 0){
+			std::vector<unsigned char>().swap(self->pending);
+			self->searchFrom = 0;
+			self->reportMemory();
+			// The frames before the bad one are still good
+			Local<Object> error = NanError("Invalid frame or frame exceeds maxLength")->ToObject();
+			error->Set(V8SYM("messages"), messages);
+			return NanThrowError(error);
+		}
+		messages->Set(count++, makeBuffer(data + offset, frameLength));
+		offset += consumed;
+	}
+
+	if (buffered){
+		self->pending.erase(self->pending.begin(), self->pending.begin() + offset);
+	}else{
+		self->pending.assign(data + offset, data + length);
+	}
+	self->reportMemory();
+
+	NanReturnValue(messages);
+}
+
+NAN_METHOD(Framer_Reset) {
+	ENTER_METHOD(Framer, 0);
+	std::vector<unsigned char>().swap(self->pending);
+	self->searchFrom = 0;
+	self->reportMemory();
+	NanReturnValue(NanUndefined());
+}
+
+void Framer::Init(Handle<Object> target){
+	Local<FunctionTemplate> tpl = NanNew<FunctionTemplate>(Framer_constructor);
+	tpl->SetClassName(NanNew("Framer"));
+	tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+	NODE_SET_PROTOTYPE_METHOD(tpl, "push", Framer_Push);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "reset", Framer_Reset);
+
+	target->Set(NanNew("Framer"), tpl->GetFunction());
+
+	NODE_DEFINE_CONSTANT(target, FRAMER_LENGTH_PREFIXED);
+	NODE_DEFINE_CONSTANT(target, FRAMER_DELIMITED);
+	NODE_DEFINE_CONSTANT(target, FRAMER_FIXED_SIZE);
+}
@@ -5,6 +5,9 @@ NAN_METHOD(SetDebugLevel);
 NAN_METHOD(GetDeviceList);
 NAN_METHOD(EnableHotplugEvents);
 NAN_METHOD(DisableHotplugEvents);
+NAN_METHOD(RegisterHotplug);
+NAN_METHOD(DeregisterHotplug);
+NAN_METHOD(SetEventThreadScheduling);
 void initConstants(Handle<Object> target);
 
 libusb_context* usb_context;
@@ -51,7 +54,22 @@ void LIBUSB_CALL onPollFDRemoved(int fd, void *user_data){
 #else
 uv_thread_t usb_thread;
 
+#ifdef __linux__
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// Kernel thread id of usb_thread, for setpriority()
+volatile pid_t usb_thread_tid = 0;
+#endif
+
 void USBThreadFn(void*){
+	#ifdef __linux__
+	usb_thread_tid = syscall(SYS_gettid);
+	#endif
 	while(1) libusb_handle_events(usb_context);
 }
 #endif
@@ -81,13 +99,19 @@ extern "C" void Initialize(Handle<Object> target) {
 	uv_thread_create(&usb_thread, USBThreadFn, NULL);
 	#endif
 
+	WorkPool::Init(target);
 	Device::Init(target);
 	Transfer::Init(target);
+	Framer::Init(target);
+	Poller::Init(target);
 
 	NODE_SET_METHOD(target, "setDebugLevel", SetDebugLevel);
 	NODE_SET_METHOD(target, "getDeviceList", GetDeviceList);
 	NODE_SET_METHOD(target, "_enableHotplugEvents", EnableHotplugEvents);
 	NODE_SET_METHOD(target, "_disableHotplugEvents", DisableHotplugEvents);
+	NODE_SET_METHOD(target, "_registerHotplug", RegisterHotplug);
+	NODE_SET_METHOD(target, "_deregisterHotplug", DeregisterHotplug);
+	NODE_SET_METHOD(target, "_setEventThreadScheduling", SetEventThreadScheduling);
 	initConstants(target);
 }
 
@@ -118,6 +142,112 @@ NAN_METHOD(GetDeviceList) {
 	NanReturnValue(arr);
 }
 
+enum SchedPolicy {
+	SCHED_POLICY_UNCHANGED = -1,
+	SCHED_POLICY_OTHER,
+	SCHED_POLICY_FIFO,
+	SCHED_POLICY_RR
+};
+
+// _setEventThreadScheduling(policy, priority, nice, cpus)
+// policy is a SchedPolicy; nice and cpus (an Array of CPU numbers) are left
+// unchanged if null.
+NAN_METHOD(SetEventThreadScheduling) {
+	NanScope();
+	CHECK_N_ARGS(4);
+	int policy, priority;
+	INT_ARG(policy, 0);
+	INT_ARG(priority, 1);
+	bool setNice = !args[2]->IsNull() && !args[2]->IsUndefined();
+	int nice = 0;
+	if (setNice){
+		INT_ARG(nice, 2);
+	}
+	bool setCpus = !args[3]->IsNull() && !args[3]->IsUndefined();
+	if (setCpus && !args[3]->IsArray()){
+		THROW_BAD_ARGS("Parameter cpus (3) should be array");
+	}
+	std::vector<unsigned> cpus;
+	if (setCpus){
+		Local<Array> list = Local<Array>::Cast(args[3]);
+		for (uint32_t i = 0; i < list->Length(); i++){
+			cpus.push_back(list->Get(i)->Uint32Value());
+		}
+	}
+
+#if defined(USE_POLL)
+	THROW_ERROR("Event thread scheduling is not available: libusb events run on the main loop");
+#elif defined(__linux__)
+	if (policy != SCHED_POLICY_UNCHANGED){
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		int p = (policy == SCHED_POLICY_FIFO) ? SCHED_FIFO :
+		        (policy == SCHED_POLICY_RR) ? SCHED_RR : SCHED_OTHER;
+		int r = pthread_setschedparam(usb_thread, p, &param);
+		if (r){
+			return NanThrowError(ErrnoException(r, "pthread_setschedparam"));
+		}
+	}
+
+	if (setNice){
+		if (!usb_thread_tid){
+			THROW_ERROR("Event thread has not started yet");
+		}
+		if (setpriority(PRIO_PROCESS, usb_thread_tid, nice)){
+			return NanThrowError(ErrnoException(errno, "setpriority"));
+		}
+	}
+
+	if (setCpus){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (auto it = cpus.begin(); it != cpus.end(); ++it){
+			if (*it >= CPU_SETSIZE){
+				THROW_BAD_ARGS("CPU number out of range");
+			}
+			CPU_SET(*it, &set);
+		}
+		int r = pthread_setaffinity_np(usb_thread, sizeof(set), &set);
+		if (r){
+			return NanThrowError(ErrnoException(r, "pthread_setaffinity_np"));
+		}
+	}
+#elif defined(_WIN32)
+	// Windows has no nice values or real-time policies for a single thread;
+	// map both onto thread priority levels.
+	int level = THREAD_PRIORITY_NORMAL;
+	if (policy == SCHED_POLICY_FIFO || policy == SCHED_POLICY_RR){
+		level = THREAD_PRIORITY_TIME_CRITICAL;
+	}else if (setNice){
+		level = (nice <= -10) ? THREAD_PRIORITY_HIGHEST :
+		        (nice < 0) ? THREAD_PRIORITY_ABOVE_NORMAL :
+		        (nice == 0) ? THREAD_PRIORITY_NORMAL :
+		        (nice < 10) ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_LOWEST;
+	}
+	if ((policy != SCHED_POLICY_UNCHANGED || setNice) && !SetThreadPriority(usb_thread, level)){
+		return NanThrowError(WinapiErrnoException(GetLastError(), "SetThreadPriority"));
+	}
+
+	if (setCpus){
+		DWORD_PTR mask = 0;
+		for (auto it = cpus.begin(); it != cpus.end(); ++it){
+			if (*it >= sizeof(mask) * 8){
+				THROW_BAD_ARGS("CPU number out of range");
+			}
+			mask |= ((DWORD_PTR) 1) << *it;
+		}
+		if (!SetThreadAffinityMask(usb_thread, mask)){
+			return NanThrowError(WinapiErrnoException(GetLastError(), "SetThreadAffinityMask"));
+		}
+	}
+#else
+	THROW_ERROR("Event thread scheduling is not supported on this platform");
+#endif
+
+	NanReturnValue(NanUndefined());
+}
+
 Persistent<Object> hotplugThis;
 
 void handleHotplug(std::pair<libusb_device*, libusb_hotplug_event> args){
@@ -186,6 +316,159 @@ NAN_METHOD(DisableHotplugEvents) {
 	NanReturnValue(NanUndefined());
 }
 
+struct HotplugEvent {
+	libusb_device* device;
+	libusb_hotplug_event event;
+	libusb_device_descriptor descriptor;
+	int descriptorStatus;
+};
+
+// A filtered hotplug subscription. Events are batched, and when coalesceMs is
+// set, held until that long after the first event of a burst.
+struct HotplugRegistration {
+	libusb_hotplug_callback_handle handle;
+	Persistent<Function> callback;
+	UVBatchQueue<HotplugEvent>* queue;
+	uv_timer_t timer;
+	unsigned coalesceMs;
+	bool closed;
+	std::vector<HotplugEvent> pending;
+};
+
+std::map<uint32_t, HotplugRegistration*> hotplugRegistrations;
+uint32_t nextHotplugId = 1;
+
+int LIBUSB_CALL filtered_hotplug_callback(libusb_context *ctx, libusb_device *dev,
+                     libusb_hotplug_event event, void *user_data) {
+	auto reg = static_cast<HotplugRegistration*>(user_data);
+	HotplugEvent e;
+	e.device = libusb_ref_device(dev);
+	e.event = event;
+	// Read here on the libusb thread so that the loop thread doesn't have to
+	e.descriptorStatus = libusb_get_device_descriptor(dev, &e.descriptor);
+	reg->queue->post(e);
+	return 0;
+}
+
+void deliverHotplugEvents(HotplugRegistration* reg, std::vector<HotplugEvent>& events){
+	NanScope();
+
+	Local<Array> v8events = NanNew<Array>();
+	uint32_t count = 0;
+
+	for (auto it = events.begin(); it != events.end(); ++it){
+		if (!reg->closed){
+			Local<Object> v8event = NanNew<Object>();
+			bool arrived = it->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+			v8event->Set(NanNew("type"), NanNew(arrived ? "attach" : "detach"));
+			v8event->Set(NanNew("device"), Device::get(it->device,
+				it->descriptorStatus == LIBUSB_SUCCESS ? &it->descriptor : NULL));
+			v8events->Set(count++, v8event);
+		}
+		libusb_unref_device(it->device);
+	}
+
+	if (count){
+		Handle<Value> argv[] = {v8events};
+		TryCatch try_catch;
+		NanMakeCallback(NanGetCurrentContext()->Global(), NanNew(reg->callback), 1, argv);
+		if (try_catch.HasCaught()) {
+			FatalException(try_catch);
+		}
+	}
+}
+
+void onHotplugCoalesced(uv_timer_t* handle){
+	auto reg = static_cast<HotplugRegistration*>(handle->data);
+	std::vector<HotplugEvent> events;
+	events.swap(reg->pending);
+	deliverHotplugEvents(reg, events);
+}
+
+void handleHotplugBatch(void* data, std::vector<HotplugEvent>& events){
+	auto reg = static_cast<HotplugRegistration*>(data);
+	if (reg->coalesceMs && !reg->closed){
+		if (reg->pending.empty()){
+			uv_timer_start(&reg->timer, (uv_timer_cb) onHotplugCoalesced, reg->coalesceMs, 0);
+		}
+		reg->pending.insert(reg->pending.end(), events.begin(), events.end());
+	}else{
+		deliverHotplugEvents(reg, events);
+	}
+}
+
+void onHotplugTimerClosed(uv_handle_t* handle){
+	auto reg = static_cast<HotplugRegistration*>(handle->data);
+	NanDisposePersistent(reg->callback);
+	delete reg;
+}
+
+// _registerHotplug(vendorId, productId, deviceClass, coalesceMs, enumerate, callback(events)) -> id
+NAN_METHOD(RegisterHotplug) {
+	NanScope();
+	CHECK_N_ARGS(6);
+	int vendorId, productId, deviceClass, coalesceMs;
+	bool enumerate;
+	INT_ARG(vendorId, 0);
+	INT_ARG(productId, 1);
+	INT_ARG(deviceClass, 2);
+	INT_ARG(coalesceMs, 3);
+	BOOL_ARG(enumerate, 4);
+	CALLBACK_ARG(5);
+	if (coalesceMs < 0){
+		THROW_BAD_ARGS("coalesceMs must not be negative");
+	}
+
+	auto reg = new HotplugRegistration;
+	reg->coalesceMs = coalesceMs;
+	reg->closed = false;
+	NanAssignPersistent(reg->callback, callback);
+	reg->queue = new UVBatchQueue<HotplugEvent>(handleHotplugBatch, reg);
+	uv_timer_init(uv_default_loop(), &reg->timer);
+	reg->timer.data = reg;
+
+	int r = libusb_hotplug_register_callback(usb_context,
+		(libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+		(libusb_hotplug_flag)(enumerate ? LIBUSB_HOTPLUG_ENUMERATE : 0),
+		vendorId, productId, deviceClass, filtered_hotplug_callback, reg, &reg->handle);
+	if (r < LIBUSB_SUCCESS){
+		reg->closed = true;
+		reg->queue->close();
+		uv_close((uv_handle_t*) &reg->timer, onHotplugTimerClosed);
+		CHECK_USB(r);
+	}
+
+	reg->queue->ref();
+	uint32_t id = nextHotplugId++;
+	hotplugRegistrations.insert(std::make_pair(id, reg));
+	NanReturnValue(NanNew<Uint32>(id));
+}
+
+NAN_METHOD(DeregisterHotplug) {
+	NanScope();
+	CHECK_N_ARGS(1);
+	int id;
+	INT_ARG(id, 0);
+
+	auto it = hotplugRegistrations.find(id);
+	if (it != hotplugRegistrations.end()){
+		HotplugRegistration* reg = it->second;
+		hotplugRegistrations.erase(it);
+
+		// No callbacks run once this returns, so whatever is still queued can
+		// be released and the handles closed.
+		libusb_hotplug_deregister_callback(usb_context, reg->handle);
+		reg->closed = true;
+		uv_timer_stop(&reg->timer);
+		handleHotplugBatch(reg, reg->pending);
+		reg->pending.clear();
+		reg->queue->unref();
+		reg->queue->close();
+		uv_close((uv_handle_t*) &reg->timer, onHotplugTimerClosed);
+	}
+	NanReturnValue(NanUndefined());
+}
+
 void initConstants(Handle<Object> target){
 	NODE_DEFINE_CONSTANT(target, LIBUSB_CLASS_PER_INTERFACE);
 	NODE_DEFINE_CONSTANT(target, LIBUSB_CLASS_AUDIO);
@@ -260,8 +543,24 @@ void initConstants(Handle<Object> target){
 	NODE_DEFINE_CONSTANT(target, LIBUSB_RECIPIENT_INTERFACE);
 	NODE_DEFINE_CONSTANT(target, LIBUSB_RECIPIENT_ENDPOINT);
 	NODE_DEFINE_CONSTANT(target, LIBUSB_RECIPIENT_OTHER);
+	// libusb_error
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_IO);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_INVALID_PARAM);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_ACCESS);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_NO_DEVICE);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_NOT_FOUND);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_BUSY);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_TIMEOUT);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_OVERFLOW);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_PIPE);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_INTERRUPTED);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_NO_MEM);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_NOT_SUPPORTED);
+	NODE_DEFINE_CONSTANT(target, LIBUSB_ERROR_OTHER);
 
 	NODE_DEFINE_CONSTANT(target, LIBUSB_CONTROL_SETUP_SIZE);
+
+	NODE_DEFINE_CONSTANT(target, LIBUSB_HOTPLUG_MATCH_ANY);
 }
 
 Local<Value> libusbException(int errorno) {
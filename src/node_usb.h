@@ -4,6 +4,9 @@
 #include <assert.h>
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
+#include <deque>
 
 #ifdef _WIN32
 #include <WinSock2.h>
@@ -19,28 +22,104 @@ using namespace v8;
 using namespace node;
 
 #include "helpers.h"
+#include "uv_async_queue.h"
 
 Local<Value> libusbException(int errorno);
+Handle<Object> makeBuffer(const unsigned char* ptr, unsigned length);
 
 
+struct Transfer;
+struct Transaction;
+
+// A cancelAll call waiting for the Transfers and Transactions it cancelled to
+// complete
+struct DrainWaiter {
+	std::set<void*> pending;
+	Persistent<Function> v8callback;
+};
+
 struct Device: public node::ObjectWrap {
 	libusb_device* device;
 	libusb_device_handle* device_handle;
+	libusb_device_descriptor descriptor;
+	bool haveDescriptor;
+
+	// Bytes pinned by submitted Transfers and Transactions. Once maxInflightBytes (if non-zero)
+	// would be exceeded, further Transfers wait in deferred until enough of
+	// the earlier ones complete. Deferred Transfers still pin their buffers;
+	// those bytes are counted in deferredBytes, and submit() fails once they
+	// would exceed maxQueuedBytes (maxInflightBytes if 0).
+	size_t inflightBytes;
+	size_t maxInflightBytes;
+	size_t maxQueuedBytes;
+	std::map<unsigned char, size_t> inflightByEndpoint;
+	std::deque<Transfer*> deferred;
+	size_t deferredBytes;
+	// Transfers handed to libusb whose completion hasn't been handled yet
+	std::set<Transfer*> submitted;
+	// Transfers per endpoint that libusb hasn't completed yet. Unlike
+	// submitted, this drops on the libusb thread, so it sees an endpoint run
+	// dry before the completions reach JS.
+	std::map<unsigned char, unsigned> activeByEndpoint;
+	uv_mutex_t activeLock;
+	// Transactions whose completion hasn't been handled yet
+	std::set<Transaction*> transactions;
+	std::vector<DrainWaiter*> drainWaiters;
 
 	static void Init(Handle<Object> exports);
-	static Handle<Value> get(libusb_device* handle);
+	static Handle<Value> get(libusb_device* handle, const libusb_device_descriptor* descriptor = NULL);
 
 	inline void ref(){Ref();}
 	inline void unref(){Unref();}
 	inline bool canClose(){return refs_ == 0;}
 	inline void attach(Handle<Object> o){Wrap(o);}
 
+	inline void addInflight(unsigned char endpoint, size_t length){
+		inflightBytes += length;
+		inflightByEndpoint[endpoint] += length;
+	}
+	inline void removeInflight(unsigned char endpoint, size_t length){
+		inflightBytes -= length;
+		inflightByEndpoint[endpoint] -= length;
+	}
+	// A single transfer larger than the whole budget is let through once
+	// nothing else is in flight.
+	inline bool overBudget(size_t length){
+		return maxInflightBytes && inflightBytes && inflightBytes + length > maxInflightBytes;
+	}
+	// Transfers are submitted in order, so anything queued behind a deferred
+	// transfer is deferred too. Control transfers are never deferred, so that
+	// a budget used up by idle IN transfers can't hold up the request that
+	// would make the device send data.
+	inline bool mustDefer(unsigned char type, size_t length){
+		if (type == LIBUSB_TRANSFER_TYPE_CONTROL) return false;
+		return !deferred.empty() || overBudget(length);
+	}
+	// A transfer larger than the whole queue is let through when it's empty
+	inline bool queueFull(size_t length){
+		size_t limit = maxQueuedBytes ? maxQueuedBytes : maxInflightBytes;
+		return !deferred.empty() && deferredBytes + length > limit;
+	}
+	void submitDeferred();
+	void defer(Transfer* t);
+	void undefer(Transfer* t);
+	void transferFinished(void* t, std::vector<DrainWaiter*>& drained);
+
 	~Device();
 	static void unpin(libusb_device* device);
 
 	protected:
 		static std::map<libusb_device*, _NanWeakCallbackInfo<Value, libusb_device>*> byPtr;
-		Device(libusb_device* d);
+		Device(libusb_device* d, const libusb_device_descriptor* dd);
+};
+
+
+// Threads of our own for blocking libusb device operations (open, reset,
+// claim, ...), so they neither wait behind nor hold up unrelated work on the
+// shared libuv threadpool.
+struct WorkPool {
+	static void Init(Handle<Object> exports);
+	static void queue(uv_work_t* req, uv_work_cb work, uv_after_work_cb after);
 };
 
 
@@ -49,6 +128,15 @@ struct Transfer: public node::ObjectWrap {
 	Device* device;
 	Persistent<Object> v8buffer;
 	Persistent<Function> v8callback;
+	// Bytes counted against the device's in-flight total
+	size_t pinned;
+	// Set by prepare(): v8buffer and the refs on this and the device are held
+	// across submissions until unprepare(), and submit() takes no arguments.
+	unsigned char* preparedBuffer;
+	int preparedLength;
+	// Set on the libusb thread: no other transfer on the endpoint was still
+	// pending when this one completed
+	bool starved;
 
 	static void Init(Handle<Object> exports);
 
@@ -56,11 +144,131 @@ struct Transfer: public node::ObjectWrap {
 	inline void unref(){Unref();}
 	inline void attach(Handle<Object> o){Wrap(o);}
 
+	int submit();
+
 	Transfer();
 	~Transfer();
 };
 
 
+enum FramerKind {
+	FRAMER_LENGTH_PREFIXED,
+	FRAMER_DELIMITED,
+	FRAMER_FIXED_SIZE
+};
+
+// Reassembles whole messages out of the arbitrary fragments read from a
+// byte-stream endpoint.
+struct Framer: public node::ObjectWrap {
+	FramerKind kind;
+	size_t maxLength;
+
+	// FRAMER_LENGTH_PREFIXED: the length field is headerSize bytes at
+	// headerOffset, and the frame spans the header plus length + lengthAdjust.
+	unsigned headerOffset;
+	unsigned headerSize;
+	bool bigEndian;
+	int lengthAdjust;
+
+	// FRAMER_DELIMITED
+	std::vector<unsigned char> delimiter;
+
+	// FRAMER_FIXED_SIZE
+	size_t recordSize;
+
+	// Bytes received but not yet part of a complete frame
+	std::vector<unsigned char> pending;
+	size_t searchFrom;
+	// pending's capacity, as last reported to V8
+	size_t reportedBytes;
+
+	static void Init(Handle<Object> exports);
+
+	inline void attach(Handle<Object> o){Wrap(o);}
+
+	// Find the frame at the start of data. Returns 1 and sets the length of the
+	// message and the number of bytes it consumes, 0 if more data is needed,
+	// or -1 if the stream is corrupt.
+	int nextFrame(const unsigned char* data, size_t length, size_t& frameLength, size_t& consumed);
+	void reportMemory();
+
+	Framer(FramerKind k);
+	~Framer();
+};
+
+
+struct PollerCompletion {
+	uint32_t index;
+	int status;
+	unsigned char* data;
+	int length;
+};
+
+// Keeps transfers in flight on many IN endpoints, across any number of
+// devices, resubmitting from the libusb thread. Completions are delivered to a
+// single callback in batches, tagged with the index returned by add().
+struct Poller: public node::ObjectWrap {
+	struct Slot {
+		Poller* poller;
+		uint32_t index;
+		Device* device;
+		Persistent<Object> v8device;
+		unsigned size;
+		std::vector<libusb_transfer*> transfers;
+		// Buffers handed back by the main thread, ready for resubmission
+		std::vector<unsigned char*> spare;
+		// Buffers allocated for this slot, at most maxBuffers. Once they are
+		// all waiting on the main thread, completed transfers are parked
+		// (still counted in inflight) until one comes back.
+		unsigned buffers;
+		unsigned maxBuffers;
+		std::vector<libusb_transfer*> parked;
+	};
+
+	std::vector<Slot*> slots;
+	Persistent<Function> v8callback;
+	Persistent<Function> v8stopCallback;
+	UVBatchQueue<PollerCompletion>* queue;
+
+	// Ring mode: records are written straight into this caller-supplied
+	// buffer on the libusb thread, and the callback is only woken up.
+	Persistent<Object> v8ring;
+	unsigned char* ring;
+	uint32_t ringCapacity;
+	bool ringNotifyPending;
+
+	// Protects running, finishing, inflight, allocatedBytes, the slots' buffer
+	// lists and writes to the ring
+	uv_mutex_t mutex;
+	bool running;
+	// The last transfer has returned but finish() hasn't run yet
+	bool finishing;
+	int inflight;
+	size_t allocatedBytes;
+	// allocatedBytes as last reported to V8, only touched on the main thread
+	size_t reportedBytes;
+
+	static const uint32_t END = 0xffffffff;
+	static const uint32_t RING_NOTIFY = 0xfffffffe;
+
+	static void Init(Handle<Object> exports);
+
+	inline void attach(Handle<Object> o){Wrap(o);}
+
+	bool busy();
+	void start();
+	bool releaseLocked();
+	void finish();
+	void reportMemory();
+	void deliverLocked(const PollerCompletion& c);
+	void returnBuffer(Slot* slot, unsigned char* buffer);
+	bool releaseParkedLocked();
+	void writeRecordLocked(const PollerCompletion& c);
+
+	Poller();
+	~Poller();
+};
+
 
 #define CHECK_USB(r) \
 	if (r < LIBUSB_SUCCESS) { \
@@ -0,0 +1,542 @@
+#include "node_usb.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define MEMORY_BARRIER() MemoryBarrier()
+#else
+#define MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+// Ring layout, all fields uint32 in host (little-endian) byte order:
+//   header: head, tail, dropped, reserved
+//   record: length, index | status << 16, timestamp (us) low, high, data
+// Records are padded to 4 bytes. head and tail are free-running byte counts,
+// so the data area must be a power of two. A length of RING_WRAP means the
+// rest of the data area is unused and the next record is at its start.
+#define RING_HEADER_SIZE 16
+#define RING_RECORD_HEADER_SIZE 16
+#define RING_WRAP 0xffffffff
+
+extern "C" void LIBUSB_CALL pollerCompletionCb(libusb_transfer *transfer);
+void handlePollerBatch(void* data, std::vector<PollerCompletion>& items);
+
+Poller::Poller(): ring(NULL), ringCapacity(0), ringNotifyPending(false),
+		running(false), finishing(false), inflight(0), allocatedBytes(0), reportedBytes(0) {
+	uv_mutex_init(&mutex);
+	queue = new UVBatchQueue<PollerCompletion>(handlePollerBatch, this);
+	DEBUG_LOG("Created Poller %p", this);
+}
+
+Poller::~Poller(){
+	DEBUG_LOG("Freed Poller %p", this);
+	assert(!running);
+	for (auto it = slots.begin(); it != slots.end(); ++it){
+		Slot* slot = *it;
+		for (auto t = slot->transfers.begin(); t != slot->transfers.end(); ++t){
+			delete[] (*t)->buffer;
+			libusb_free_transfer(*t);
+		}
+		for (auto b = slot->spare.begin(); b != slot->spare.end(); ++b){
+			delete[] *b;
+		}
+		NanDisposePersistent(slot->v8device);
+		delete slot;
+	}
+	NanDisposePersistent(v8callback);
+	NanDisposePersistent(v8stopCallback);
+	NanDisposePersistent(v8ring);
+	queue->close();
+	uv_mutex_destroy(&mutex);
+	NanAdjustExternalMemory(-(int) reportedBytes);
+}
+
+// Buffers are allocated on the libusb thread, which can't talk to V8, so the
+// total is reported from the main thread as batches come in.
+void Poller::reportMemory(){
+	uv_mutex_lock(&mutex);
+	size_t allocated = allocatedBytes;
+	uv_mutex_unlock(&mutex);
+
+	if (allocated != reportedBytes){
+		NanAdjustExternalMemory((int) allocated - (int) reportedBytes);
+		reportedBytes = allocated;
+	}
+}
+
+bool Poller::busy(){
+	uv_mutex_lock(&mutex);
+	bool r = running || inflight > 0 || finishing;
+	uv_mutex_unlock(&mutex);
+	return r;
+}
+
+// Drop one in-flight reference; returns true if that was the last one, in
+// which case the caller must post END. The poller stays busy until finish().
+bool Poller::releaseLocked(){
+	if (--inflight == 0){
+		running = false;
+		finishing = true;
+		return true;
+	}
+	return false;
+}
+
+// Append a record to the ring, or count it as dropped if the consumer has
+// fallen too far behind.
+void Poller::writeRecordLocked(const PollerCompletion& c){
+	volatile uint32_t* header = (volatile uint32_t*) ring;
+	unsigned char* base = ring + RING_HEADER_SIZE;
+
+	uint32_t head = header[0];
+	uint32_t tail = header[1];
+	uint32_t pos = head & (ringCapacity - 1);
+	uint32_t size = RING_RECORD_HEADER_SIZE + ((c.length + 3) & ~3u);
+	uint32_t skip = (ringCapacity - pos < size) ? ringCapacity - pos : 0;
+
+	if (size > ringCapacity || (head - tail) + skip + size > ringCapacity){
+		header[2]++;
+		return;
+	}
+
+	if (skip){
+		*(uint32_t*) (base + pos) = RING_WRAP;
+		head += skip;
+		pos = 0;
+	}
+
+	uint32_t* record = (uint32_t*) (base + pos);
+	uint64_t timestamp = uv_hrtime() / 1000;
+	record[0] = c.length;
+	record[1] = (c.index & 0xffff) | ((uint32_t) (uint16_t) (int16_t) c.status << 16);
+	record[2] = (uint32_t) timestamp;
+	record[3] = (uint32_t) (timestamp >> 32);
+	if (c.length){
+		memcpy(record + 4, c.data, c.length);
+	}
+
+	// The record must be visible before the consumer can see the new head
+	MEMORY_BARRIER();
+	header[0] = head + size;
+}
+
+// Hand a completion to the main thread, or in ring mode, to the ring
+void Poller::deliverLocked(const PollerCompletion& c){
+	if (!ring){
+		queue->post(c);
+		return;
+	}
+
+	writeRecordLocked(c);
+	if (!ringNotifyPending){
+		ringNotifyPending = true;
+		PollerCompletion n = {RING_NOTIFY, 0, NULL, 0};
+		queue->post(n);
+	}
+}
+
+void Poller::start(){
+	Ref();
+	queue->ref();
+	for (auto it = slots.begin(); it != slots.end(); ++it){
+		(*it)->device->ref();
+	}
+
+	// Hold a reference of our own so that transfers failing while we're still
+	// submitting don't end the run early.
+	uv_mutex_lock(&mutex);
+	running = true;
+	inflight = 1;
+	uv_mutex_unlock(&mutex);
+
+	for (auto it = slots.begin(); it != slots.end(); ++it){
+		Slot* slot = *it;
+		for (auto t = slot->transfers.begin(); t != slot->transfers.end(); ++t){
+			libusb_transfer* transfer = *t;
+			transfer->dev_handle = slot->device->device_handle;
+			uv_mutex_lock(&mutex);
+			if (!transfer->buffer){
+				if (!slot->spare.empty()){
+					transfer->buffer = slot->spare.back();
+					slot->spare.pop_back();
+				}else{
+					transfer->buffer = new unsigned char[slot->size];
+					slot->buffers++;
+					allocatedBytes += slot->size;
+				}
+			}
+			inflight++;
+			uv_mutex_unlock(&mutex);
+
+			int r = libusb_submit_transfer(transfer);
+			if (r < 0){
+				PollerCompletion c = {slot->index, r, NULL, 0};
+				uv_mutex_lock(&mutex);
+				deliverLocked(c);
+				inflight--;
+				uv_mutex_unlock(&mutex);
+			}
+		}
+	}
+
+	uv_mutex_lock(&mutex);
+	bool ended = releaseLocked();
+	uv_mutex_unlock(&mutex);
+	if (ended){
+		PollerCompletion c = {END, 0, NULL, 0};
+		queue->post(c);
+	}
+
+	reportMemory();
+}
+
+// A buffer delivered to JS is free again: resubmit a parked transfer with
+// it, or keep it for the next completion.
+void Poller::returnBuffer(Slot* slot, unsigned char* buffer){
+	uv_mutex_lock(&mutex);
+	if (slot->parked.empty()){
+		slot->spare.push_back(buffer);
+		uv_mutex_unlock(&mutex);
+		return;
+	}
+
+	libusb_transfer* transfer = slot->parked.back();
+	slot->parked.pop_back();
+	transfer->buffer = buffer;
+
+	bool ended = false;
+	int r = running ? libusb_submit_transfer(transfer) : LIBUSB_ERROR_INTERRUPTED;
+	if (r < 0){
+		if (running){
+			PollerCompletion c = {slot->index, r, NULL, 0};
+			deliverLocked(c);
+		}
+		ended = releaseLocked();
+	}
+	uv_mutex_unlock(&mutex);
+
+	if (ended){
+		PollerCompletion c = {END, 0, NULL, 0};
+		queue->post(c);
+	}
+}
+
+// Release every parked transfer once polling has stopped; returns true if
+// that ended the run.
+bool Poller::releaseParkedLocked(){
+	bool ended = false;
+	for (auto it = slots.begin(); it != slots.end(); ++it){
+		Slot* slot = *it;
+		while (!slot->parked.empty()){
+			slot->parked.pop_back();
+			ended = releaseLocked() || ended;
+		}
+	}
+	return ended;
+}
+
+// Called on the main thread once the last transfer has come back
+void Poller::finish(){
+	for (auto it = slots.begin(); it != slots.end(); ++it){
+		(*it)->device->unref();
+	}
+	queue->unref();
+
+	// From here on, the stop callback may start() a new run
+	uv_mutex_lock(&mutex);
+	finishing = false;
+	uv_mutex_unlock(&mutex);
+
+	if (!v8stopCallback.IsEmpty()){
+		Local<Function> callback = NanNew(v8stopCallback);
+		NanDisposePersistent(v8stopCallback);
+		TryCatch try_catch;
+		NanMakeCallback(NanObjectWrapHandle(this), callback, 0, NULL);
+		if (try_catch.HasCaught()) {
+			FatalException(try_catch);
+		}
+	}
+
+	Unref();
+}
+
+extern "C" void LIBUSB_CALL pollerCompletionCb(libusb_transfer *transfer){
+	Poller::Slot* slot = static_cast<Poller::Slot*>(transfer->user_data);
+	Poller* self = slot->poller;
+	DEBUG_LOG("Poller completion %p %i %i", self, slot->index, transfer->status);
+
+	PollerCompletion c = {slot->index, transfer->status, NULL, 0};
+
+	uv_mutex_lock(&self->mutex);
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED){
+		c.data = transfer->buffer;
+		c.length = transfer->actual_length;
+		// Unless the data is copied into the ring right away, hand the filled
+		// buffer to the main thread and resubmit with a spare one, so the
+		// endpoint is never left idle waiting for JS.
+		if (!self->ring){
+			if (!slot->spare.empty()){
+				transfer->buffer = slot->spare.back();
+				slot->spare.pop_back();
+			}else if (slot->buffers < slot->maxBuffers){
+				transfer->buffer = new unsigned char[slot->size];
+				slot->buffers++;
+				self->allocatedBytes += slot->size;
+			}else{
+				transfer->buffer = NULL;
+			}
+		}
+	}
+
+	if (c.data || (c.status != LIBUSB_TRANSFER_CANCELLED && c.status != LIBUSB_TRANSFER_TIMED_OUT)){
+		self->deliverLocked(c);
+	}
+
+	bool resubmit = self->running && (transfer->status == LIBUSB_TRANSFER_COMPLETED
+		|| transfer->status == LIBUSB_TRANSFER_TIMED_OUT);
+	if (resubmit && !transfer->buffer){
+		// The main thread is behind; wait for it to hand a buffer back
+		slot->parked.push_back(transfer);
+		uv_mutex_unlock(&self->mutex);
+		return;
+	}
+	if (resubmit){
+		int r = libusb_submit_transfer(transfer);
+		if (r < 0){
+			PollerCompletion e = {slot->index, r, NULL, 0};
+			self->deliverLocked(e);
+			resubmit = false;
+		}
+	}
+	bool ended = !resubmit && self->releaseLocked();
+
+	uv_mutex_unlock(&self->mutex);
+
+	if (ended){
+		PollerCompletion e = {Poller::END, 0, NULL, 0};
+		self->queue->post(e);
+	}
+}
+
+void handlePollerBatch(void* data, std::vector<PollerCompletion>& items){
+	NanScope();
+	Poller* self = static_cast<Poller*>(data);
+
+	Local<Array> indexes = NanNew<Array>();
+	Local<Array> buffers = NanNew<Array>();
+	Local<Array> errors;
+	uint32_t count = 0;
+	bool ended = false;
+	bool readable = false;
+
+	for (auto it = items.begin(); it != items.end(); ++it){
+		if (it->index == Poller::END){
+			ended = true;
+			continue;
+		}
+		if (it->index == Poller::RING_NOTIFY){
+			// Records written from here on need a new wakeup
+			uv_mutex_lock(&self->mutex);
+			self->ringNotifyPending = false;
+			uv_mutex_unlock(&self->mutex);
+			readable = true;
+			continue;
+		}
+
+		Poller::Slot* slot = self->slots[it->index];
+		indexes->Set(count, NanNew<Uint32>(it->index));
+		if (it->data){
+			buffers->Set(count, makeBuffer(it->data, it->length));
+			self->returnBuffer(slot, it->data);
+		}
+		if (it->status != LIBUSB_TRANSFER_COMPLETED){
+			if (errors.IsEmpty()){
+				errors = NanNew<Array>();
+			}
+			errors->Set(count, libusbException(it->status));
+		}
+		count++;
+	}
+
+	if (count && !self->v8callback.IsEmpty()){
+		Handle<Value> error_list = NanUndefined();
+		if (!errors.IsEmpty()){
+			error_list = errors;
+		}
+		Handle<Value> argv[] = {indexes, buffers, error_list};
+		TryCatch try_catch;
+		NanMakeCallback(NanObjectWrapHandle(self), NanNew(self->v8callback), 3, argv);
+		if (try_catch.HasCaught()) {
+			FatalException(try_catch);
+		}
+	}
+
+	if (readable && !self->v8callback.IsEmpty()){
+		TryCatch try_catch;
+		NanMakeCallback(NanObjectWrapHandle(self), NanNew(self->v8callback), 0, NULL);
+		if (try_catch.HasCaught()) {
+			FatalException(try_catch);
+		}
+	}
+
+	self->reportMemory();
+
+	if (ended){
+		self->finish();
+	}
+}
+
+// new Poller(callback(indexes, buffers, errors))
+NAN_METHOD(Poller_constructor) {
+	ENTER_CONSTRUCTOR(1);
+	CALLBACK_ARG(0);
+
+	auto self = new Poller();
+	self->attach(args.This());
+	NanAssignPersistent(self->v8callback, callback);
+
+	NanReturnValue(args.This());
+}
+
+// Poller.add(device, endpointAddr, type, nTransfers, transferSize) -> index
+NAN_METHOD(Poller_Add) {
+	ENTER_METHOD(Poller, 5);
+	UNWRAP_ARG(Device, device, 0);
+	int endpoint, type, nTransfers, size;
+	INT_ARG(endpoint, 1);
+	INT_ARG(type, 2);
+	INT_ARG(nTransfers, 3);
+	INT_ARG(size, 4);
+
+	if (self->busy()){
+		THROW_ERROR("Can't add endpoints while polling");
+	}
+	if (!(endpoint & LIBUSB_ENDPOINT_IN)){
+		THROW_BAD_ARGS("Endpoint must be an IN endpoint");
+	}
+	if (nTransfers <= 0 || size <= 0){
+		THROW_BAD_ARGS("nTransfers and transferSize must be positive");
+	}
+
+	auto slot = new Poller::Slot;
+	slot->poller = self;
+	slot->index = self->slots.size();
+	slot->device = device;
+	slot->size = size;
+	slot->buffers = 0;
+	// Room for a full set of transfers in flight while another is waiting on
+	// the main thread
+	slot->maxBuffers = 2 * nTransfers;
+	NanAssignPersistent(slot->v8device, args[0]->ToObject());
+
+	for (int i = 0; i < nTransfers; i++){
+		libusb_transfer* transfer = libusb_alloc_transfer(0);
+		transfer->callback = pollerCompletionCb;
+		transfer->user_data = slot;
+		transfer->endpoint = endpoint;
+		transfer->type = type;
+		transfer->timeout = 0;
+		transfer->length = size;
+		transfer->buffer = NULL;
+		slot->transfers.push_back(transfer);
+	}
+
+	self->slots.push_back(slot);
+	NanReturnValue(NanNew<Uint32>(slot->index));
+}
+
+// Poller.setRing(buffer | null): switch to (or out of) ring mode
+NAN_METHOD(Poller_SetRing) {
+	ENTER_METHOD(Poller, 1);
+
+	if (self->busy()){
+		THROW_ERROR("Can't change delivery mode while polling");
+	}
+
+	if (args[0]->IsNull() || args[0]->IsUndefined()){
+		NanDisposePersistent(self->v8ring);
+		self->ring = NULL;
+		self->ringCapacity = 0;
+		NanReturnValue(NanUndefined());
+	}
+
+	if (!Buffer::HasInstance(args[0])){
+		THROW_BAD_ARGS("Ring arg [0] must be Buffer");
+	}
+	Local<Object> buffer_obj = args[0]->ToObject();
+	size_t length = Buffer::Length(buffer_obj);
+	size_t capacity = length - RING_HEADER_SIZE;
+	if (length <= RING_HEADER_SIZE || capacity > 0x80000000 || (capacity & (capacity - 1))
+			|| ((uintptr_t) Buffer::Data(buffer_obj) & 3)){
+		THROW_BAD_ARGS("Ring must be an aligned Buffer of 16 bytes plus a power of two");
+	}
+
+	NanAssignPersistent(self->v8ring, buffer_obj);
+	self->ring = (unsigned char*) Buffer::Data(buffer_obj);
+	self->ringCapacity = capacity;
+	memset(self->ring, 0, RING_HEADER_SIZE);
+	NanReturnValue(NanUndefined());
+}
+
+NAN_METHOD(Poller_Start) {
+	ENTER_METHOD(Poller, 0);
+
+	if (self->busy()){
+		THROW_ERROR("Polling already active");
+	}
+	for (auto it = self->slots.begin(); it != self->slots.end(); ++it){
+		if (!(*it)->device->device_handle){
+			THROW_ERROR("Device is not open");
+		}
+	}
+
+	self->start();
+	NanReturnValue(NanUndefined());
+}
+
+// Poller.stop([callback]): callback is called once every transfer has returned
+NAN_METHOD(Poller_Stop) {
+	ENTER_METHOD(Poller, 0);
+	CALLBACK_ARG(0);
+
+	uv_mutex_lock(&self->mutex);
+	bool running = self->running;
+	self->running = false;
+	bool ended = running && self->releaseParkedLocked();
+	uv_mutex_unlock(&self->mutex);
+
+	if (!running){
+		THROW_ERROR("Polling is not active");
+	}
+	if (!callback.IsEmpty()){
+		NanAssignPersistent(self->v8stopCallback, callback);
+	}
+	if (ended){
+		PollerCompletion c = {Poller::END, 0, NULL, 0};
+		self->queue->post(c);
+	}
+
+	for (auto it = self->slots.begin(); it != self->slots.end(); ++it){
+		auto& transfers = (*it)->transfers;
+		for (auto t = transfers.begin(); t != transfers.end(); ++t){
+			// Transfers that already completed report LIBUSB_ERROR_NOT_FOUND
+			libusb_cancel_transfer(*t);
+		}
+	}
+
+	NanReturnValue(NanUndefined());
+}
+
+void Poller::Init(Handle<Object> target){
+	Local<FunctionTemplate> tpl = NanNew<FunctionTemplate>(Poller_constructor);
+	tpl->SetClassName(NanNew("Poller"));
+	tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+	NODE_SET_PROTOTYPE_METHOD(tpl, "add", Poller_Add);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "setRing", Poller_SetRing);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "start", Poller_Start);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "stop", Poller_Stop);
+
+	target->Set(NanNew("Poller"), tpl->GetFunction());
+}
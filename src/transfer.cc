@@ -1,4 +1,5 @@
 #include "node_usb.h"
+#include <algorithm>
 
 extern "C" void LIBUSB_CALL usbCompletionCb(libusb_transfer *transfer);
 void handleCompletion(Transfer* t);
@@ -8,7 +9,19 @@ void handleCompletion(Transfer* t);
 UVQueue<Transfer*> completionQueue(handleCompletion);
 #endif
 
-Transfer::Transfer(){
+// Report a transfer that never reached libusb as completed, with the status
+// already set on it.
+static void completeUnsubmitted(Transfer* t){
+	t->transfer->actual_length = 0;
+	t->starved = false;
+	#ifdef USE_POLL
+	handleCompletion(t);
+	#else
+	completionQueue.post(t);
+	#endif
+}
+
+Transfer::Transfer(): pinned(0), preparedBuffer(NULL), preparedLength(0), starved(false) {
 	transfer = libusb_alloc_transfer(0);
 	transfer->callback = usbCompletionCb;
 	transfer->user_data = this;
@@ -44,18 +57,22 @@ NAN_METHOD(Transfer_constructor) {
 	NanReturnValue(args.This());
 }
 
-// Transfer.submit(buffer, callback)
+// Transfer.submit(buffer), or Transfer.submit() once prepared
 NAN_METHOD(Transfer_Submit) {
-	ENTER_METHOD(Transfer, 1);
+	ENTER_METHOD(Transfer, 0);
 
 	if (self->transfer->buffer){
 		THROW_ERROR("Transfer is already active")
 	}
 
-	if (!Buffer::HasInstance(args[0])){
+	bool prepared = self->preparedBuffer != NULL;
+	if (prepared){
+		if (args.Length() > 0 && Buffer::HasInstance(args[0])){
+			THROW_ERROR("Transfer is prepared; submit() takes no buffer");
+		}
+	}else if (args.Length() < 1 || !Buffer::HasInstance(args[0])){
 		THROW_BAD_ARGS("Buffer arg [0] must be Buffer");
 	}
-	Local<Object> buffer_obj = args[0]->ToObject();
 	if (!self->device->device_handle){
 		THROW_ERROR("Device is not open");
 	}
@@ -63,12 +80,18 @@ NAN_METHOD(Transfer_Submit) {
 	// Can't be cached in constructor as device could be closed and re-opened
 	self->transfer->dev_handle = self->device->device_handle;
 
-	NanAssignPersistent(self->v8buffer, buffer_obj);
-	self->transfer->buffer = (unsigned char*) Buffer::Data(buffer_obj);
-	self->transfer->length = Buffer::Length(buffer_obj);
+	if (prepared){
+		self->transfer->buffer = self->preparedBuffer;
+		self->transfer->length = self->preparedLength;
+	}else{
+		Local<Object> buffer_obj = args[0]->ToObject();
+		NanAssignPersistent(self->v8buffer, buffer_obj);
+		self->transfer->buffer = (unsigned char*) Buffer::Data(buffer_obj);
+		self->transfer->length = Buffer::Length(buffer_obj);
 
-	self->ref();
-	self->device->ref();
+		self->ref();
+		self->device->ref();
+	}
 
 	#ifndef USE_POLL
 	completionQueue.ref();
@@ -84,15 +107,153 @@ NAN_METHOD(Transfer_Submit) {
 		self->transfer->buffer
 	);
 
-	CHECK_USB(libusb_submit_transfer(self->transfer));
+	int r;
+	if (self->device->mustDefer(self->transfer->type, self->transfer->length)){
+		if (!self->device->queueFull(self->transfer->length)){
+			DEBUG_LOG("Deferring %p, %i bytes in flight", self, (int) self->device->inflightBytes);
+			self->device->defer(self);
+			NanReturnValue(args.This());
+		}
+		// Backpressure: the caller has to wait for earlier transfers
+		r = LIBUSB_ERROR_BUSY;
+	}else{
+		r = self->submit();
+	}
+	if (r < LIBUSB_SUCCESS){
+		#ifndef USE_POLL
+		completionQueue.unref();
+		#endif
+		self->transfer->buffer = NULL;
+		if (!prepared){
+			self->device->unref();
+			NanDisposePersistent(self->v8buffer);
+			self->unref();
+		}
+		CHECK_USB(r);
+	}
+	NanReturnValue(args.This());
+}
+
+// Transfer.prepare(buffer): bind buffer to the transfer, so that it can be
+// resubmitted with submit() and no per-submission handle or refcount churn.
+NAN_METHOD(Transfer_Prepare) {
+	ENTER_METHOD(Transfer, 1);
+
+	if (self->transfer->buffer){
+		THROW_ERROR("Transfer is already active")
+	}
+	if (!Buffer::HasInstance(args[0])){
+		THROW_BAD_ARGS("Buffer arg [0] must be Buffer");
+	}
+	Local<Object> buffer_obj = args[0]->ToObject();
+
+	if (self->preparedBuffer){
+		NanDisposePersistent(self->v8buffer);
+	}else{
+		self->ref();
+		self->device->ref();
+	}
+	NanAssignPersistent(self->v8buffer, buffer_obj);
+	self->preparedBuffer = (unsigned char*) Buffer::Data(buffer_obj);
+	self->preparedLength = Buffer::Length(buffer_obj);
+
+	NanReturnValue(args.This());
+}
+
+// Transfer.unprepare(): release the buffer bound by prepare()
+NAN_METHOD(Transfer_Unprepare) {
+	ENTER_METHOD(Transfer, 0);
+
+	if (self->transfer->buffer){
+		THROW_ERROR("Transfer is already active")
+	}
+	if (!self->preparedBuffer){
+		NanReturnValue(args.This());
+	}
+
+	NanDisposePersistent(self->v8buffer);
+	self->preparedBuffer = NULL;
+	self->preparedLength = 0;
+	self->device->unref();
+	self->unref();
+
 	NanReturnValue(args.This());
 }
 
+int Transfer::submit(){
+	pinned = transfer->length;
+	starved = false;
+	device->addInflight(transfer->endpoint, pinned);
+	uv_mutex_lock(&device->activeLock);
+	device->activeByEndpoint[transfer->endpoint]++;
+	uv_mutex_unlock(&device->activeLock);
+	int r = libusb_submit_transfer(transfer);
+	if (r < LIBUSB_SUCCESS){
+		uv_mutex_lock(&device->activeLock);
+		device->activeByEndpoint[transfer->endpoint]--;
+		uv_mutex_unlock(&device->activeLock);
+		device->removeInflight(transfer->endpoint, pinned);
+		pinned = 0;
+	}else{
+		device->submitted.insert(this);
+	}
+	return r;
+}
+
+// Called as the completion of t, a Transfer or Transaction, is handled.
+// Removes t from the cancelAll calls waiting on it, and moves those left with
+// nothing pending to drained.
+void Device::transferFinished(void* t, std::vector<DrainWaiter*>& drained){
+	for (auto it = drainWaiters.begin(); it != drainWaiters.end();){
+		(*it)->pending.erase(t);
+		if ((*it)->pending.empty()){
+			drained.push_back(*it);
+			it = drainWaiters.erase(it);
+		}else{
+			++it;
+		}
+	}
+}
+
+void Device::defer(Transfer* t){
+	deferred.push_back(t);
+	deferredBytes += t->transfer->length;
+}
+
+// Account for t having been removed from deferred
+void Device::undefer(Transfer* t){
+	deferredBytes -= t->transfer->length;
+}
+
+// Submit deferred transfers for as long as they fit in the in-flight budget
+void Device::submitDeferred(){
+	while (!deferred.empty()){
+		Transfer* t = deferred.front();
+		if (overBudget(t->transfer->length)){
+			break;
+		}
+		deferred.pop_front();
+		undefer(t);
+
+		DEBUG_LOG("Submitting deferred %p", t);
+		int r = t->submit();
+		if (r < LIBUSB_SUCCESS){
+			t->transfer->status = (r == LIBUSB_ERROR_NO_DEVICE) ?
+				LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+			completeUnsubmitted(t);
+		}
+	}
+}
+
 extern "C" void LIBUSB_CALL usbCompletionCb(libusb_transfer *transfer){
 	Transfer* t = static_cast<Transfer*>(transfer->user_data);
 	DEBUG_LOG("Completion callback %p", t);
 	assert(t != NULL);
 
+	uv_mutex_lock(&t->device->activeLock);
+	t->starved = --t->device->activeByEndpoint[transfer->endpoint] == 0;
+	uv_mutex_unlock(&t->device->activeLock);
+
 	#ifdef USE_POLL
 	handleCompletion(t);
 	#else
@@ -100,19 +261,51 @@ extern "C" void LIBUSB_CALL usbCompletionCb(libusb_transfer *transfer){
 	#endif
 }
 
+// Call back the cancelAll calls that have nothing left pending
+static void notifyDrained(Device* device, std::vector<DrainWaiter*>& drained){
+	for (auto it = drained.begin(); it != drained.end(); ++it){
+		Local<Function> callback = NanNew((*it)->v8callback);
+		NanDisposePersistent((*it)->v8callback);
+		delete *it;
+		TryCatch try_catch;
+		NanMakeCallback(NanObjectWrapHandle(device), callback, 0, NULL);
+		if (try_catch.HasCaught()) {
+			FatalException(try_catch);
+		}
+	}
+}
+
 void handleCompletion(Transfer* self){
 	NanScope();
 	DEBUG_LOG("HandleCompletion %p", self);
 
-	self->device->unref();
+	// A prepared transfer keeps its refs and buffer handle for the next submit
+	bool prepared = self->preparedBuffer != NULL;
+	if (!prepared){
+		self->device->unref();
+	}
 	#ifndef USE_POLL
 	completionQueue.unref();
 	#endif
 
+	if (self->pinned){
+		self->device->removeInflight(self->transfer->endpoint, self->pinned);
+		self->pinned = 0;
+		self->device->submitDeferred();
+	}
+
+	// Work out which cancelAll calls this completes before the callback can
+	// resubmit, but only report them after it has run.
+	std::vector<DrainWaiter*> drained;
+	self->device->submitted.erase(self);
+	self->device->transferFinished(self, drained);
+
 	// The callback may resubmit and overwrite these, so need to clear the
 	// persistent first.
 	Local<Object> buffer = NanNew<Object>(self->v8buffer);
-	NanDisposePersistent(self->v8buffer);
+	if (!prepared){
+		NanDisposePersistent(self->v8buffer);
+	}
 	self->transfer->buffer = NULL;
 
 	if (!self->v8callback.IsEmpty()) {
@@ -121,20 +314,36 @@ void handleCompletion(Transfer* self){
 			error = libusbException(self->transfer->status);
 		}
 		Handle<Value> argv[] = {error, buffer,
-			NanNew<Uint32>((uint32_t) self->transfer->actual_length)};
+			NanNew<Uint32>((uint32_t) self->transfer->actual_length),
+			NanNew<Boolean>(self->starved)};
 		TryCatch try_catch;
-		NanMakeCallback(NanObjectWrapHandle(self), NanNew(self->v8callback), 3, argv);
+		NanMakeCallback(NanObjectWrapHandle(self), NanNew(self->v8callback), 4, argv);
 		if (try_catch.HasCaught()) {
 			FatalException(try_catch);
 		}
 	}
 
-	self->unref();
+	notifyDrained(self->device, drained);
+
+	if (!prepared){
+		self->unref();
+	}
 }
 
 NAN_METHOD(Transfer_Cancel){
 	ENTER_METHOD(Transfer, 0);
 	DEBUG_LOG("Cancel %p %i", self, !!self->transfer->buffer);
+
+	auto& deferred = self->device->deferred;
+	auto it = std::find(deferred.begin(), deferred.end(), self);
+	if (it != deferred.end()){
+		deferred.erase(it);
+		self->device->undefer(self);
+		self->transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		completeUnsubmitted(self);
+		NanReturnValue(NanTrue());
+	}
+
 	int r = libusb_cancel_transfer(self->transfer);
 	if (r == LIBUSB_ERROR_NOT_FOUND){
 		// Not useful to throw an error for this case
@@ -145,13 +354,291 @@ NAN_METHOD(Transfer_Cancel){
 	}
 }
 
+// A command/response exchange: the IN transfer is submitted from the OUT
+// transfer's completion on the libusb thread, so the reply is read without a
+// round trip through JS, and the caller gets a single callback.
+struct Transaction {
+	libusb_transfer* out;
+	libusb_transfer* in;
+	Device* device;
+	Persistent<Object> v8outBuffer;
+	Persistent<Object> v8inBuffer;
+	Persistent<Function> v8callback;
+	int status;
+	// Guards cancelled against the OUT completion submitting the IN transfer
+	uv_mutex_t mutex;
+	bool cancelled;
+};
+
+extern "C" void LIBUSB_CALL transactionOutCb(libusb_transfer *transfer);
+extern "C" void LIBUSB_CALL transactionInCb(libusb_transfer *transfer);
+void handleTransaction(Transaction* t);
+
+#ifndef USE_POLL
+UVQueue<Transaction*> transactionQueue(handleTransaction);
+#endif
+
+static void postTransaction(Transaction* t){
+	#ifdef USE_POLL
+	handleTransaction(t);
+	#else
+	transactionQueue.post(t);
+	#endif
+}
+
+extern "C" void LIBUSB_CALL transactionOutCb(libusb_transfer *transfer){
+	Transaction* t = static_cast<Transaction*>(transfer->user_data);
+	DEBUG_LOG("Transaction OUT complete %p %i", t, transfer->status);
+
+	uv_mutex_lock(&t->mutex);
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && t->cancelled){
+		t->status = LIBUSB_TRANSFER_CANCELLED;
+	}else if (transfer->status == LIBUSB_TRANSFER_COMPLETED){
+		t->status = libusb_submit_transfer(t->in);
+		if (t->status == LIBUSB_SUCCESS){
+			uv_mutex_unlock(&t->mutex);
+			return;
+		}
+	}else{
+		t->status = transfer->status;
+	}
+	uv_mutex_unlock(&t->mutex);
+	postTransaction(t);
+}
+
+extern "C" void LIBUSB_CALL transactionInCb(libusb_transfer *transfer){
+	Transaction* t = static_cast<Transaction*>(transfer->user_data);
+	DEBUG_LOG("Transaction IN complete %p %i", t, transfer->status);
+	t->status = transfer->status;
+	postTransaction(t);
+}
+
+static void freeTransaction(Transaction* t){
+	NanDisposePersistent(t->v8outBuffer);
+	NanDisposePersistent(t->v8inBuffer);
+	NanDisposePersistent(t->v8callback);
+	libusb_free_transfer(t->out);
+	libusb_free_transfer(t->in);
+	uv_mutex_destroy(&t->mutex);
+	delete t;
+}
+
+static void addTransactionInflight(Device* device, Transaction* t){
+	device->addInflight(t->out->endpoint, t->out->length);
+	device->addInflight(t->in->endpoint, t->in->length);
+}
+
+static void removeTransactionInflight(Device* device, Transaction* t){
+	device->removeInflight(t->out->endpoint, t->out->length);
+	device->removeInflight(t->in->endpoint, t->in->length);
+}
+
+// Cancel whichever half of t is in flight. Once cancelled is set, the OUT
+// completion won't submit the IN transfer.
+static void cancelTransaction(Transaction* t){
+	uv_mutex_lock(&t->mutex);
+	t->cancelled = true;
+	libusb_cancel_transfer(t->out);
+	libusb_cancel_transfer(t->in);
+	uv_mutex_unlock(&t->mutex);
+}
+
+void handleTransaction(Transaction* t){
+	NanScope();
+	DEBUG_LOG("HandleTransaction %p", t);
+
+	Device* self = t->device;
+	Local<Object> device = NanObjectWrapHandle(self);
+	self->unref();
+	#ifndef USE_POLL
+	transactionQueue.unref();
+	#endif
+
+	removeTransactionInflight(self, t);
+	self->submitDeferred();
+
+	std::vector<DrainWaiter*> drained;
+	self->transactions.erase(t);
+	self->transferFinished(t, drained);
+
+	Handle<Value> error = NanUndefined();
+	if (t->status != LIBUSB_TRANSFER_COMPLETED){
+		error = libusbException(t->status);
+	}
+	Handle<Value> argv[] = {error, NanNew<Object>(t->v8inBuffer),
+		NanNew<Uint32>((uint32_t) t->in->actual_length)};
+	Local<Function> callback = NanNew(t->v8callback);
+	freeTransaction(t);
+
+	TryCatch try_catch;
+	NanMakeCallback(device, callback, 3, argv);
+	if (try_catch.HasCaught()) {
+		FatalException(try_catch);
+	}
+
+	notifyDrained(self, drained);
+}
+
+static libusb_transfer* makeTransactionTransfer(Transaction* t, Device* device, int endpoint, int type,
+		int timeout, Local<Object> buffer_obj, libusb_transfer_cb_fn callback){
+	libusb_transfer* transfer = libusb_alloc_transfer(0);
+	transfer->dev_handle = device->device_handle;
+	transfer->endpoint = endpoint;
+	transfer->type = type;
+	transfer->timeout = timeout;
+	transfer->buffer = (unsigned char*) Buffer::Data(buffer_obj);
+	transfer->length = Buffer::Length(buffer_obj);
+	transfer->callback = callback;
+	transfer->user_data = t;
+	return transfer;
+}
+
+// _transact(device, outEndpoint, outType, outBuffer, outTimeout,
+//           inEndpoint, inType, inBuffer, inTimeout, callback(error, inBuffer, actual))
+NAN_METHOD(Transaction_Submit) {
+	NanScope();
+	CHECK_N_ARGS(10);
+	UNWRAP_ARG(Device, device, 0);
+	int outEndpoint, outType, outTimeout, inEndpoint, inType, inTimeout;
+	INT_ARG(outEndpoint, 1);
+	INT_ARG(outType, 2);
+	if (!Buffer::HasInstance(args[3])){
+		THROW_BAD_ARGS("Buffer arg [3] must be Buffer");
+	}
+	INT_ARG(outTimeout, 4);
+	INT_ARG(inEndpoint, 5);
+	INT_ARG(inType, 6);
+	if (!Buffer::HasInstance(args[7])){
+		THROW_BAD_ARGS("Buffer arg [7] must be Buffer");
+	}
+	INT_ARG(inTimeout, 8);
+	CALLBACK_ARG(9);
+
+	if (!device->device_handle){
+		THROW_ERROR("Device is not open");
+	}
+
+	auto t = new Transaction;
+	t->device = device;
+	t->status = LIBUSB_TRANSFER_COMPLETED;
+	t->cancelled = false;
+	uv_mutex_init(&t->mutex);
+	t->out = makeTransactionTransfer(t, device, outEndpoint, outType, outTimeout,
+		args[3]->ToObject(), transactionOutCb);
+	t->in = makeTransactionTransfer(t, device, inEndpoint, inType, inTimeout,
+		args[7]->ToObject(), transactionInCb);
+	NanAssignPersistent(t->v8outBuffer, args[3]->ToObject());
+	NanAssignPersistent(t->v8inBuffer, args[7]->ToObject());
+	NanAssignPersistent(t->v8callback, callback);
+
+	device->ref();
+	#ifndef USE_POLL
+	transactionQueue.ref();
+	#endif
+
+	addTransactionInflight(device, t);
+	int r = libusb_submit_transfer(t->out);
+	if (r < LIBUSB_SUCCESS){
+		removeTransactionInflight(device, t);
+		device->unref();
+		#ifndef USE_POLL
+		transactionQueue.unref();
+		#endif
+		freeTransaction(t);
+		CHECK_USB(r);
+	}
+	device->transactions.insert(t);
+
+	NanReturnValue(NanUndefined());
+}
+
+// _cancelAll(device, endpointAddrs | null, callback) -> number of transfers
+// Cancels every transfer and transaction on the device, or on the listed
+// endpoints, including transfers deferred by maxInflightBytes. Once all of them have completed, the
+// callback is called. It isn't called if nothing was pending.
+NAN_METHOD(Transfer_CancelAll) {
+	NanScope();
+	CHECK_N_ARGS(3);
+	UNWRAP_ARG(Device, device, 0);
+	bool all = args[1]->IsNull() || args[1]->IsUndefined();
+	if (!all && !args[1]->IsArray()){
+		THROW_BAD_ARGS("Parameter endpoints (1) should be array");
+	}
+	CALLBACK_ARG(2);
+	if (callback.IsEmpty()){
+		THROW_BAD_ARGS("Argument 2 must be a function");
+	}
+
+	std::set<unsigned char> endpoints;
+	if (!all){
+		Local<Array> list = Local<Array>::Cast(args[1]);
+		for (uint32_t i = 0; i < list->Length(); i++){
+			endpoints.insert((unsigned char) list->Get(i)->Uint32Value());
+		}
+	}
+
+	auto waiter = new DrainWaiter;
+
+	for (auto it = device->submitted.begin(); it != device->submitted.end(); ++it){
+		Transfer* t = *it;
+		if (all || endpoints.count(t->transfer->endpoint)){
+			waiter->pending.insert(t);
+			// Transfers that already completed report LIBUSB_ERROR_NOT_FOUND
+			libusb_cancel_transfer(t->transfer);
+		}
+	}
+
+	for (auto it = device->transactions.begin(); it != device->transactions.end(); ++it){
+		Transaction* t = *it;
+		if (all || endpoints.count(t->out->endpoint) || endpoints.count(t->in->endpoint)){
+			waiter->pending.insert(t);
+			cancelTransaction(t);
+		}
+	}
+
+	std::vector<Transfer*> unsubmitted;
+	auto& deferred = device->deferred;
+	for (auto it = deferred.begin(); it != deferred.end();){
+		Transfer* t = *it;
+		if (all || endpoints.count(t->transfer->endpoint)){
+			it = deferred.erase(it);
+			device->undefer(t);
+			waiter->pending.insert(t);
+			unsubmitted.push_back(t);
+		}else{
+			++it;
+		}
+	}
+
+	uint32_t count = waiter->pending.size();
+	if (!count){
+		delete waiter;
+		NanReturnValue(NanNew<Uint32>(0));
+	}
+	NanAssignPersistent(waiter->v8callback, callback);
+	device->drainWaiters.push_back(waiter);
+
+	// With USE_POLL these complete right away, so the waiter must be in place
+	for (auto it = unsubmitted.begin(); it != unsubmitted.end(); ++it){
+		(*it)->transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		completeUnsubmitted(*it);
+	}
+
+	NanReturnValue(NanNew<Uint32>(count));
+}
+
 void Transfer::Init(Handle<Object> target){
 	Local<FunctionTemplate> tpl = NanNew<FunctionTemplate>(Transfer_constructor);
 	tpl->SetClassName(NanNew("Transfer"));
 	tpl->InstanceTemplate()->SetInternalFieldCount(1);
 
 	NODE_SET_PROTOTYPE_METHOD(tpl, "submit", Transfer_Submit);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "prepare", Transfer_Prepare);
+	NODE_SET_PROTOTYPE_METHOD(tpl, "unprepare", Transfer_Unprepare);
 	NODE_SET_PROTOTYPE_METHOD(tpl, "cancel", Transfer_Cancel);
 
 	target->Set(NanNew("Transfer"), tpl->GetFunction());
+
+	NODE_SET_METHOD(target, "_transact", Transaction_Submit);
+	NODE_SET_METHOD(target, "_cancelAll", Transfer_CancelAll);
 }
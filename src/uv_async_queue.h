@@ -4,6 +4,7 @@
 #include <uv.h>
 #include <node_version.h>
 #include <queue>
+#include <vector>
 #include "polyfill.h"
 
 template <class T>
@@ -70,4 +71,81 @@ class UVQueue{
 		}
 };
 
+// Like UVQueue, but hands everything posted since the last wakeup to the
+// callback in one call. Allocated per owner, and deleted by close() once libuv
+// is done with the handle.
+template <class T>
+class UVBatchQueue{
+	public:
+		typedef void (*fptr)(void* data, std::vector<T>& items);
+
+		UVBatchQueue(fptr cb, void* _data): callback(cb), data(_data), ref_count(0) {
+			uv_mutex_init(&mutex);
+			uv_async_init(uv_default_loop(), &async, UVBatchQueue::internal_callback);
+			async.data = this;
+			uv_unref((uv_handle_t*)&async);
+		}
+
+		void post(T value){
+			uv_mutex_lock(&mutex);
+			queue.push_back(value);
+			uv_mutex_unlock(&mutex);
+			uv_async_send(&async);
+		}
+
+		// Delivers anything still queued and closes the handle. Nothing may be
+		// posted after this.
+		void close(){
+			drain();
+			uv_close((uv_handle_t*)&async, UVBatchQueue::close_callback);
+		}
+
+		void ref(){
+			ref_count++;
+			if (ref_count == 1) {
+				uv_ref((uv_handle_t*)&async);
+			}
+		}
+
+		void unref(){
+			ref_count--;
+			if (ref_count == 0) {
+				uv_unref((uv_handle_t*)&async);
+			}
+		}
+
+	private:
+		fptr callback;
+		void* data;
+		std::vector<T> queue;
+		std::vector<T> draining;
+		uv_mutex_t mutex;
+		uv_async_t async;
+		int ref_count;
+
+		~UVBatchQueue(){
+			uv_mutex_destroy(&mutex);
+		}
+
+		static void close_callback(uv_handle_t* handle){
+			delete static_cast<UVBatchQueue*>(handle->data);
+		}
+
+		void drain(){
+			// Swap rather than copy, so both vectors keep their capacity
+			uv_mutex_lock(&mutex);
+			draining.swap(queue);
+			uv_mutex_unlock(&mutex);
+
+			if (!draining.empty()){
+				callback(data, draining);
+				draining.clear();
+			}
+		}
+
+		static UV_ASYNC_CB(internal_callback){
+			static_cast<UVBatchQueue*>(handle->data)->drain();
+		}
+};
+
 #endif
@@ -0,0 +1,116 @@
+#include "node_usb.h"
+
+struct WorkItem {
+	uv_work_t* req;
+	uv_work_cb work;
+	uv_after_work_cb after;
+	uint64_t queuedAt;
+};
+
+void handleWorkDone(WorkItem item);
+
+static UVQueue<WorkItem> doneQueue(handleWorkDone);
+
+// Everything below is protected by mutex
+static uv_mutex_t mutex;
+static uv_cond_t cond;
+static std::queue<WorkItem> pending;
+static std::vector<uv_thread_t*> threads;
+static unsigned poolSize = 4;
+static unsigned active = 0;
+static uint64_t completed = 0;
+static uint64_t totalWait = 0;
+static uint64_t maxWait = 0;
+
+static void workerThreadFn(void*){
+	while (1){
+		uv_mutex_lock(&mutex);
+		while (pending.empty()){
+			uv_cond_wait(&cond, &mutex);
+		}
+		WorkItem item = pending.front();
+		pending.pop();
+		uint64_t wait = uv_hrtime() - item.queuedAt;
+		totalWait += wait;
+		if (wait > maxWait) maxWait = wait;
+		active++;
+		uv_mutex_unlock(&mutex);
+
+		item.work(item.req);
+
+		uv_mutex_lock(&mutex);
+		active--;
+		completed++;
+		uv_mutex_unlock(&mutex);
+
+		doneQueue.post(item);
+	}
+}
+
+// Called with mutex held
+static void startThreads(){
+	while (threads.size() < poolSize){
+		uv_thread_t* thread = new uv_thread_t;
+		uv_thread_create(thread, workerThreadFn, NULL);
+		threads.push_back(thread);
+	}
+}
+
+void handleWorkDone(WorkItem item){
+	doneQueue.unref();
+	item.after(item.req, 0);
+}
+
+void WorkPool::queue(uv_work_t* req, uv_work_cb work, uv_after_work_cb after){
+	WorkItem item = {req, work, after, uv_hrtime()};
+	doneQueue.ref();
+
+	uv_mutex_lock(&mutex);
+	startThreads();
+	pending.push(item);
+	uv_cond_signal(&cond);
+	uv_mutex_unlock(&mutex);
+}
+
+NAN_METHOD(SetWorkerPoolSize) {
+	NanScope();
+	if (args.Length() != 1 || !args[0]->IsUint32() || args[0]->Uint32Value() < 1) {
+		THROW_BAD_ARGS("Usb::SetWorkerPoolSize argument is invalid. [uint >= 1]!")
+	}
+
+	uv_mutex_lock(&mutex);
+	// Threads are started on first use and never stopped, so the pool can
+	// only grow once it is running.
+	if (args[0]->Uint32Value() > threads.size()){
+		poolSize = args[0]->Uint32Value();
+		if (!threads.empty()){
+			startThreads();
+		}
+	}
+	uv_mutex_unlock(&mutex);
+	NanReturnValue(NanUndefined());
+}
+
+NAN_METHOD(GetWorkerPoolStats) {
+	NanScope();
+	Local<Object> stats = NanNew<Object>();
+
+	uv_mutex_lock(&mutex);
+	stats->Set(NanNew("threads"), NanNew<Uint32>((uint32_t) threads.size()));
+	stats->Set(NanNew("queued"), NanNew<Uint32>((uint32_t) pending.size()));
+	stats->Set(NanNew("active"), NanNew<Uint32>(active));
+	stats->Set(NanNew("completed"), NanNew<Number>((double) completed));
+	stats->Set(NanNew("totalQueueWaitMs"), NanNew<Number>(totalWait / 1e6));
+	stats->Set(NanNew("maxQueueWaitMs"), NanNew<Number>(maxWait / 1e6));
+	uv_mutex_unlock(&mutex);
+
+	NanReturnValue(stats);
+}
+
+void WorkPool::Init(Handle<Object> target){
+	uv_mutex_init(&mutex);
+	uv_cond_init(&cond);
+
+	NODE_SET_METHOD(target, "setWorkerPoolSize", SetWorkerPoolSize);
+	NODE_SET_METHOD(target, "getWorkerPoolStats", GetWorkerPoolStats);
+}
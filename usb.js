@@ -27,45 +27,193 @@ exports.findByIds = function(vid, pid) {
 	}
 }
 
+var SCHED_POLICIES = {other: 0, fifo: 1, rr: 2}
+
+// Set the scheduling policy, priority, nice value and CPU affinity of the
+// libusb event thread, which runs transfer callbacks. Omitted options are left
+// unchanged.
+exports.setEventThreadScheduling = function(options) {
+	var policy = -1
+	if (options.policy !== undefined){
+		policy = SCHED_POLICIES[options.policy]
+		if (policy === undefined){
+			throw new TypeError("Unknown scheduling policy: " + options.policy)
+		}
+	}
+	usb._setEventThreadScheduling(policy, options.priority || 0,
+		options.nice === undefined ? null : options.nice,
+		options.cpus || null)
+}
+
+// Create a native framer that reassembles whole messages from the fragments
+// read from a byte-stream endpoint. See InEndpoint.framer.
+exports.createFramer = function(options) {
+	options = options || {}
+	var maxLength = options.maxLength || 65536
+
+	switch (options.type){
+		case 'length':
+			return new usb.Framer(usb.FRAMER_LENGTH_PREFIXED, maxLength,
+				options.headerOffset || 0, options.headerSize || 2,
+				!!options.bigEndian, options.lengthAdjust || 0)
+		case 'delimiter':
+			var delimiter = options.delimiter
+			if (!Buffer.isBuffer(delimiter)){
+				delimiter = new Buffer(delimiter)
+			}
+			return new usb.Framer(usb.FRAMER_DELIMITED, maxLength, delimiter)
+		case 'fixed':
+			return new usb.Framer(usb.FRAMER_FIXED_SIZE, maxLength, options.recordSize)
+		default:
+			throw new TypeError("Unknown framer type: " + options.type)
+	}
+}
+
 usb.Device.prototype.timeout = 1000
 
-usb.Device.prototype.open = function(){
-	this.__open()
-	this.interfaces = []
-	var len = this.configDescriptor.interfaces.length
-	for (var i=0; i<len; i++){
-		this.interfaces[i] = new Interface(this, i)
+usb.Device.prototype.open = function(callback){
+	var self = this
+	if (callback){
+		this.__open(function(err){
+			if (!err){
+				self.__openInterfaces()
+			}
+			callback.call(self, err)
+		})
+	}else{
+		this.__open()
+		this.__openInterfaces()
 	}
 }
 
+// Interface objects are only created when first accessed, so opening a
+// composite device doesn't read the config descriptor or build an object for
+// every interface and endpoint up front.
+usb.Device.prototype.__openInterfaces = function(){
+	this._interfaces = []
+	this._interfaceList = null
+	this._interfaceIndex = null
+}
+
 usb.Device.prototype.close = function(){
 	this.__close()
-	this.interfaces = null
+	this.disableReconnect()
+	this._interfaces = this._interfaceList = this._interfaceIndex = null
 }
 
+usb.Device.prototype.__interfaceAt = function(i){
+	return this._interfaces[i] || (this._interfaces[i] = new Interface(this, i))
+}
+
+Object.defineProperty(usb.Device.prototype, "interfaces", {
+	get: function() {
+		if (!this._interfaces) return this._interfaces
+		if (!this._interfaceList){
+			var list = []
+			var len = this.configDescriptor.interfaces.length
+			for (var i=0; i<len; i++){
+				list[i] = this.__interfaceAt(i)
+			}
+			this._interfaceList = list
+		}
+		return this._interfaceList
+	}
+});
+
 Object.defineProperty(usb.Device.prototype, "configDescriptor", {
 	get: function() {
 		return this._configDescriptor || (this._configDescriptor = this.__getConfigDescriptor())
 	}
 });
 
+// Bytes pinned by this device's submitted transfers
+Object.defineProperty(usb.Device.prototype, "inflightBytes", {
+	get: function() {
+		return this.__getInflightBytes()
+	}
+});
+
+// Bytes pinned by transfers queued behind maxInflightBytes
+Object.defineProperty(usb.Device.prototype, "queuedBytes", {
+	get: function() {
+		return this.__getQueuedBytes()
+	}
+});
+
+// Cap on inflightBytes; transfers submitted beyond it are queued until
+// earlier ones complete. 0 (the default) is unlimited.
+Object.defineProperty(usb.Device.prototype, "maxInflightBytes", {
+	get: function() {
+		return this._maxInflightBytes || 0
+	},
+	set: function(bytes) {
+		this.__setMaxInflightBytes(bytes)
+		this._maxInflightBytes = bytes
+	}
+});
+
+// Cap on queuedBytes; submitting beyond it fails with LIBUSB_ERROR_BUSY.
+// 0 (the default) uses maxInflightBytes.
+Object.defineProperty(usb.Device.prototype, "maxQueuedBytes", {
+	get: function() {
+		return this._maxQueuedBytes || 0
+	},
+	set: function(bytes) {
+		this.__setMaxQueuedBytes(bytes)
+		this._maxQueuedBytes = bytes
+	}
+});
+
+// Cancel every transfer on `addresses` (all endpoints if null) in one native
+// call, and call cb once all of them have completed.
+function cancelTransfers(device, addresses, self, cb){
+	var n = usb._cancelAll(device, addresses, function(){
+		if (cb) cb.call(self)
+	})
+	if (n == 0 && cb){
+		process.nextTick(function(){ cb.call(self) })
+	}
+}
+
+// Keep ep's poll transfers from being resubmitted as they are cancelled, or
+// restarted by reconnect. Only materialized endpoints can be polling.
+function endPoll(ep){
+	if (!ep) return
+	ep.pollActive = false
+	ep._pollArgs = null
+}
+
+usb.Device.prototype.cancelTransfers = function(cb){
+	(this._interfaces || []).forEach(function(iface){
+		if (iface) iface._endpoints.forEach(endPoll)
+	})
+	cancelTransfers(this, null, this, cb)
+}
+
 usb.Device.prototype.interface = function(addr){
-	if (!this.interfaces){
+	if (!this._interfaces){
 		throw new Error("Device must be open before searching for interfaces")
 	}
 	addr = addr || 0
-	for (var i=0; i<this.interfaces.length; i++){
-		if (this.interfaces[i].interfaceNumber == addr){
-			return this.interfaces[i]
-		}
+	if (!this._interfaceIndex){
+		// bInterfaceNumber -> index in configDescriptor.interfaces
+		var index = this._interfaceIndex = []
+		this.configDescriptor.interfaces.forEach(function(alts, i){
+			index[alts[0].bInterfaceNumber] = i
+		})
+	}
+	var i = this._interfaceIndex[addr]
+	if (i !== undefined){
+		return this.__interfaceAt(i)
 	}
 }
 
 var SETUP_SIZE = usb.LIBUSB_CONTROL_SETUP_SIZE
 
-usb.Device.prototype.controlTransfer =
-function(bmRequestType, bRequest, wValue, wIndex, data_or_length, callback){
-	var self = this
+// Check the data argument against the direction in bmRequestType, and build
+// the buffer for a control transfer: the setup packet, followed by the data
+// to send or room for the data to receive.
+function controlBuffer(bmRequestType, bRequest, wValue, wIndex, data_or_length){
 	var isIn = !!(bmRequestType & usb.LIBUSB_ENDPOINT_IN)
 	var wLength
 
@@ -93,6 +241,14 @@ function(bmRequestType, bRequest, wValue, wIndex, data_or_length, callback){
 	if (!isIn){
 		data_or_length.copy(buf, SETUP_SIZE)
 	}
+	return buf
+}
+
+usb.Device.prototype.controlTransfer =
+function(bmRequestType, bRequest, wValue, wIndex, data_or_length, callback){
+	var self = this
+	var isIn = !!(bmRequestType & usb.LIBUSB_ENDPOINT_IN)
+	var buf = controlBuffer(bmRequestType, bRequest, wValue, wIndex, data_or_length)
 
 	var transfer = new usb.Transfer(this, 0, usb.LIBUSB_TRANSFER_TYPE_CONTROL, this.timeout,
 		function(error, buf, actual){
@@ -114,6 +270,25 @@ function(bmRequestType, bRequest, wValue, wIndex, data_or_length, callback){
 	return this;
 }
 
+// Blocking variant of controlTransfer; returns the number of bytes transferred
+usb.Device.prototype.controlTransferSync =
+function(bmRequestType, bRequest, wValue, wIndex, buffer){
+	return this.__controlTransferSync(bmRequestType, bRequest, wValue, wIndex,
+		buffer || new Buffer(0), this.timeout)
+}
+
+// Promise-returning variant of controlTransfer. Resolves with the data read
+// for IN requests, or the number of bytes written for OUT requests.
+usb.Device.prototype.controlTransferAsync =
+function(bmRequestType, bRequest, wValue, wIndex, data_or_length){
+	var isIn = !!(bmRequestType & usb.LIBUSB_ENDPOINT_IN)
+	var buf = controlBuffer(bmRequestType, bRequest, wValue, wIndex, data_or_length)
+
+	var t = pooledTransfer(this, this, 0, usb.LIBUSB_TRANSFER_TYPE_CONTROL, this.timeout,
+		isIn ? RESULT_CONTROL_IN : RESULT_OUT)
+	return submitPooled(t, buf)
+}
+
 usb.Device.prototype.getStringDescriptor = function (desc_index, callback) {
 	var langid = 0x0409;
 	var length = 255;
@@ -130,6 +305,70 @@ usb.Device.prototype.getStringDescriptor = function (desc_index, callback) {
 	);
 }
 
+// The promise-returning transfer APIs keep a few idle Transfer objects per
+// endpoint and share one completion callback, which finds the promise's
+// resolve/reject functions on the transfer itself. A call then costs no more
+// than a callback-style transfer.
+var TRANSFER_POOL_SIZE = 8
+var RESULT_IN = 0, RESULT_OUT = 1, RESULT_CONTROL_IN = 2
+
+function pooledTransfer(owner, device, address, type, timeout, result){
+	if (typeof Promise == 'undefined'){
+		throw new Error("Promise is not available in this version of Node")
+	}
+	var pool = owner._transferPool || (owner._transferPool = [])
+	var t
+	while ((t = pool.pop())){
+		// The timeout is fixed when the transfer is created
+		if (t._timeout === timeout) break
+	}
+	if (!t){
+		t = new usb.Transfer(device, address, type, timeout, settlePooled)
+		t._pool = pool
+		t._timeout = timeout
+	}
+	t._result = result
+	return t
+}
+
+function submitPooled(t, buffer){
+	return new Promise(function(resolve, reject){
+		t._resolve = resolve
+		t._reject = reject
+		try {
+			t.submit(buffer)
+		} catch (e) {
+			// The transfer never went out, so it can be reused right away
+			t._resolve = t._reject = null
+			if (t._pool.length < TRANSFER_POOL_SIZE){
+				t._pool.push(t)
+			}
+			throw e
+		}
+	})
+}
+
+function settlePooled(error, buf, actual){
+	var resolve = this._resolve, reject = this._reject
+	this._resolve = this._reject = null
+	if (this._pool.length < TRANSFER_POOL_SIZE){
+		this._pool.push(this)
+	}
+
+	if (error){
+		reject(error)
+	}else switch (this._result){
+		case RESULT_IN:
+			resolve(actual == buf.length ? buf : buf.slice(0, actual))
+			break
+		case RESULT_CONTROL_IN:
+			resolve(buf.slice(SETUP_SIZE, SETUP_SIZE + actual))
+			break
+		default:
+			resolve(actual)
+	}
+}
+
 function Interface(device, id){
 	this.device = device
 	this.id = id
@@ -137,20 +376,62 @@ function Interface(device, id){
 	this.__refresh()
 }
 
+// Endpoint objects for the current alternate setting are created on first
+// access; changing the alternate setting starts a fresh set.
 Interface.prototype.__refresh = function(){
-	this.descriptor = this.device.configDescriptor.interfaces[this.id][this.altSetting]
-	this.interfaceNumber = this.descriptor.bInterfaceNumber
-	this.endpoints = []
-	var len = this.descriptor.endpoints.length
-	for (var i=0; i<len; i++){
+	this._endpoints = []
+	this._endpointList = null
+	this._endpointIndex = null
+}
+
+Interface.prototype.__endpointAt = function(i){
+	if (!this._endpoints[i]){
 		var desc = this.descriptor.endpoints[i]
 		var c = (desc.bEndpointAddress&usb.LIBUSB_ENDPOINT_IN)?InEndpoint:OutEndpoint
-		this.endpoints[i] = new c(this.device, desc)
+		this._endpoints[i] = new c(this.device, desc)
 	}
+	return this._endpoints[i]
 }
 
-Interface.prototype.claim = function(){
-	this.device.__claimInterface(this.id)
+Object.defineProperty(Interface.prototype, "descriptor", {
+	get: function() {
+		return this.device.configDescriptor.interfaces[this.id][this.altSetting]
+	}
+});
+
+Object.defineProperty(Interface.prototype, "interfaceNumber", {
+	get: function() {
+		return this.descriptor.bInterfaceNumber
+	}
+});
+
+Object.defineProperty(Interface.prototype, "endpoints", {
+	get: function() {
+		if (!this._endpointList){
+			var list = []
+			var len = this.descriptor.endpoints.length
+			for (var i=0; i<len; i++){
+				list[i] = this.__endpointAt(i)
+			}
+			this._endpointList = list
+		}
+		return this._endpointList
+	}
+});
+
+Interface.prototype.claim = function(cb){
+	var self = this
+	if (!cb){
+		this.device.__claimInterface(this.id)
+		this._claimed = true
+		return
+	}
+	this.device.__claimInterface(this.id, function(err){
+		if (!err){
+			self._claimed = true
+		}
+		cb.call(self, err)
+	})
 }
 
 Interface.prototype.release = function(closeEndpoints, cb){
@@ -160,25 +441,16 @@ Interface.prototype.release = function(closeEndpoints, cb){
 		closeEndpoints = null;
 	}
 
-	if (!closeEndpoints || this.endpoints.length == 0) {
+	if (!closeEndpoints) {
 		next();
 	} else {
-		var n = self.endpoints.length;
-		self.endpoints.forEach(function (ep, i) {
-			if (ep.pollActive) {
-				ep.once('end', function () {
-					if (--n == 0) next();
-				});
-				ep.stopPoll();
-			} else {
-				if (--n == 0) next();
-			}
-		});
+		this.cancelTransfers(next);
 	}
 
 	function next () {
 		self.device.__releaseInterface(self.id, function(err){
 			if (!err){
+				self._claimed = false;
 				self.altSetting = 0;
 				self.__refresh()
 			}
@@ -191,12 +463,31 @@ Interface.prototype.isKernelDriverActive = function(){
 	return this.device.__isKernelDriverActive(this.id)
 }
 
-Interface.prototype.detachKernelDriver = function() {
-	return this.device.__detachKernelDriver(this.id)
+// _detached is recorded so that reconnect can detach the driver again
+Interface.prototype.detachKernelDriver = function(cb) {
+	var self = this
+	if (!cb){
+		var r = this.device.__detachKernelDriver(this.id)
+		this._detached = true
+		return r
+	}
+	this.device.__detachKernelDriver(this.id, function(err){
+		if (!err) self._detached = true
+		cb.call(self, err)
+	})
 };
 
-Interface.prototype.attachKernelDriver = function() {
-	return this.device.__attachKernelDriver(this.id)
+Interface.prototype.attachKernelDriver = function(cb) {
+	var self = this
+	if (!cb){
+		var r = this.device.__attachKernelDriver(this.id)
+		this._detached = false
+		return r
+	}
+	this.device.__attachKernelDriver(this.id, function(err){
+		if (!err) self._detached = false
+		cb.call(self, err)
+	})
 };
 
 
@@ -212,11 +503,27 @@ Interface.prototype.setAltSetting = function(altSetting, cb){
 
 }
 
+// Cancel every transfer on this interface's endpoints, stopping any polls; cb
+// is called once they have all completed
+Interface.prototype.cancelTransfers = function(cb){
+	var addresses = this.descriptor.endpoints.map(function(desc){
+		return desc.bEndpointAddress
+	})
+	this._endpoints.forEach(endPoll)
+	cancelTransfers(this.device, addresses, this, cb)
+}
+
 Interface.prototype.endpoint = function(addr){
-	for (var i=0; i<this.endpoints.length; i++){
-		if (this.endpoints[i].address == addr){
-			return this.endpoints[i]
-		}
+	if (!this._endpointIndex){
+		// bEndpointAddress -> index in descriptor.endpoints
+		var index = this._endpointIndex = []
+		this.descriptor.endpoints.forEach(function(desc, i){
+			index[desc.bEndpointAddress] = i
+		})
+	}
+	var i = this._endpointIndex[addr]
+	if (i !== undefined){
+		return this.__endpointAt(i)
 	}
 }
 
@@ -230,10 +537,34 @@ util.inherits(Endpoint, events.EventEmitter)
 
 Endpoint.prototype.timeout = 0
 
+Object.defineProperty(Endpoint.prototype, "inflightBytes", {
+	get: function() {
+		return this.device.__getInflightBytes(this.address)
+	}
+});
+
+// Cancel every transfer on this endpoint, stopping any poll; cb is called once
+// they have all completed
+Endpoint.prototype.cancelTransfers = function(cb){
+	endPoll(this)
+	cancelTransfers(this.device, [this.address], this, cb)
+}
+
 Endpoint.prototype.makeTransfer = function(timeout, callback){
 	return new usb.Transfer(this.device, this.address, this.transferType, timeout, callback)
 }
 
+// Blocking transfer into / out of buffer; returns the number of bytes transferred.
+// Endpoints default to an infinite timeout, which would hang the event loop,
+// so a non-zero timeout must be passed here or set on the endpoint.
+Endpoint.prototype.transferSync = function(buffer, timeout){
+	timeout = timeout || this.timeout
+	if (!timeout){
+		throw new TypeError("transferSync requires a non-zero timeout")
+	}
+	return this.device.__transferSync(this.address, this.transferType, buffer, timeout)
+}
+
 Endpoint.prototype.startPoll = function(nTransfers, transferSize, callback){
 	if (this.pollTransfers){
 		throw new Error("Polling already active")
@@ -252,6 +583,12 @@ Endpoint.prototype.startPoll = function(nTransfers, transferSize, callback){
 }
 
 Endpoint.prototype.stopPoll = function(cb){
+	// Only an explicit stop keeps reconnect from restarting the poll
+	this._pollArgs = null
+	this.__cancelPoll(cb)
+}
+
+Endpoint.prototype.__cancelPoll = function(cb){
 	if (!this.pollTransfers) {
 		throw new Error('Polling is not active.');
 	}
@@ -286,40 +623,193 @@ InEndpoint.prototype.transfer = function(length, cb){
 	return this;
 }
 
+// Bounds and window for startPoll's automatic tuning
+function pollTuning(endpoint, options){
+	var packet = endpoint.descriptor.wMaxPacketSize
+	function roundUp(size){
+		return Math.max(packet, Math.ceil(size / packet) * packet)
+	}
+	var t = {
+		minTransfers: options.minTransfers || 2,
+		maxTransfers: options.maxTransfers || 32,
+		minTransferSize: roundUp(options.minTransferSize || packet),
+		maxTransferSize: roundUp(options.maxTransferSize || 64 * packet),
+		window: options.window || 32,
+		interval: options.interval || 250,
+		roundUp: roundUp,
+	}
+	t.maxTransfers = Math.max(t.maxTransfers, t.minTransfers)
+	t.maxTransferSize = Math.max(t.maxTransferSize, t.minTransferSize)
+	return t
+}
+
+// Promise-returning variant of transfer; resolves with the data read
+InEndpoint.prototype.transferAsync = function(length){
+	var t = pooledTransfer(this, this.device, this.address, this.transferType, this.timeout, RESULT_IN)
+	return submitPooled(t, new Buffer(length))
+}
+
 InEndpoint.prototype.startPoll = function(nTransfers, transferSize){
 	var self = this
+	var pollArgs = [nTransfers, transferSize]
+	var tuning = null
+	if (nTransfers && typeof nTransfers == 'object'){
+		tuning = pollTuning(this, nTransfers)
+		nTransfers = Math.min(Math.max(3, tuning.minTransfers), tuning.maxTransfers)
+		transferSize = tuning.minTransferSize
+	}
+	if (this.framer){
+		this.framer.reset()
+	}
 	this.pollTransfers = InEndpoint.super_.prototype.startPoll.call(this, nTransfers, transferSize, transferDone)
+	this._pollArgs = pollArgs
+	var targetTransfers = this.pollTransfers.length
+
+	var completions = 0, received = 0, capacity = 0, starved = 0
+	// The window is also closed on a timer, so that an endpoint that has gone
+	// idle still gives its transfers back.
+	var timer = null
+	if (tuning){
+		timer = setInterval(evaluate, tuning.interval)
+		if (timer.unref) timer.unref()
+	}
+
+	// Called for each successful completion. ranDry is set natively when no
+	// other transfer on the endpoint was still pending, so the device may have
+	// had nowhere to put data.
+	function tune(actual, size, ranDry){
+		completions++
+		received += actual
+		capacity += size
+		if (ranDry) starved++
+		if (completions >= tuning.window) evaluate()
+	}
 
-	function transferDone(error, buf, actual){
+	// Once per window, grow the transfers that came back full, add transfers
+	// if the queue ran dry, and give memory back when the endpoint is mostly
+	// idle.
+	function evaluate(){
+		if (!self.pollActive) return
+
+		// Nothing completed at all counts as empty
+		var fill = capacity ? received / capacity : 0
+		var busy = completions >= tuning.window
+
+		// Halving can leave a partial packet, which could overflow
+		if (fill > 0.9){
+			self.pollTransferSize = Math.min(tuning.roundUp(self.pollTransferSize * 2), tuning.maxTransferSize)
+		}else if (fill < 0.25){
+			self.pollTransferSize = Math.max(tuning.roundUp(self.pollTransferSize / 2), tuning.minTransferSize)
+		}
+
+		if (starved){
+			targetTransfers = Math.min(targetTransfers * 2, tuning.maxTransfers)
+		}else if (!busy){
+			targetTransfers = Math.max(targetTransfers - 1, tuning.minTransfers)
+		}
+
+		while (self.pollActive && self.pollTransfers.length < targetTransfers){
+			var t = self.makeTransfer(0, transferDone)
+			if (!startTransfer(t)) break
+			self.pollTransfers.push(t)
+			self.pollPending++
+		}
+		// An idle endpoint has no completions to retire transfers on, so cancel
+		// the surplus; they are retired as their cancellations complete.
+		if (self.pollActive){
+			self.pollTransfers.slice(targetTransfers).forEach(function(t){ t.cancel() })
+		}
+
+		completions = received = capacity = starved = 0
+	}
+
+	function transferDone(error, buf, actual, ranDry){
 		if (!error){
-			self.emit("data", buf.slice(0, actual))
+			if (tuning && self.pollActive){
+				tune(actual, buf.length, ranDry)
+			}
+			if (self.framer){
+				var messages = null, framingError = null
+				try {
+					messages = self.framer.push(buf, actual)
+				} catch (e) {
+					framingError = e
+					messages = e.messages
+				}
+				if (messages && messages.length){
+					self.emit("messages", messages)
+				}
+				if (framingError){
+					self.emit("error", framingError)
+					self.__cancelPoll()
+				}
+			}else{
+				self.emit("data", buf.slice(0, actual))
+			}
 		}else if (error.errno != usb.LIBUSB_TRANSFER_CANCELLED){
 			self.emit("error", error)
-			self.stopPoll()
+			self.__cancelPoll()
 		}
 
-		if (self.pollActive){
-			startTransfer(this)
-		}else{
+		if (self.pollActive && self.pollTransfers.length > targetTransfers){
+			// Retire this transfer to shrink the queue
+			releaseTransfer(this)
+			self.pollTransfers.splice(self.pollTransfers.indexOf(this), 1)
 			self.pollPending--
-
-			if (self.pollPending == 0){
-				self.emit('end')
-			}
+		}else if (!self.pollActive || !startTransfer(this)){
+			releaseTransfer(this)
+			self.pollPending--
+			if (self.pollPending == 0) ended()
 		}
 	}
 
+	function ended(){
+		clearInterval(timer)
+		self.pollTransfers = null
+		self.emit('end')
+	}
+
 	function startTransfer(t){
 		try {
-			t.submit(new Buffer(self.pollTransferSize), transferDone);
+			if (self.framer){
+				// The framer copies what it keeps, so the buffer is bound once and
+				// reused for every resubmission
+				if (!t._prepared || t._prepared.length != self.pollTransferSize){
+					t._prepared = new Buffer(self.pollTransferSize)
+					t.prepare(t._prepared)
+				}
+				t.submit()
+			}else{
+				t.submit(new Buffer(self.pollTransferSize), transferDone);
+			}
+			return true
 		} catch (e) {
+			releaseTransfer(t)
 			self.emit("error", e);
-			self.stopPoll();
+			self.__cancelPoll();
+			return false
+		}
+	}
+
+	function releaseTransfer(t){
+		if (t._prepared){
+			t.unprepare()
+			t._prepared = null
 		}
 	}
 
-	this.pollTransfers.forEach(startTransfer)
-	self.pollPending = this.pollTransfers.length
+	// Only transfers that were actually submitted are pending, or 'end' would
+	// never be emitted
+	var transfers = this.pollTransfers
+	this.pollTransfers = []
+	for (var i = 0; i < transfers.length && this.pollActive; i++){
+		if (!startTransfer(transfers[i])) break
+		this.pollTransfers.push(transfers[i])
+		this.pollPending++
+	}
+	if (this.pollPending == 0){
+		process.nextTick(ended)
+	}
 }
 
 
@@ -352,6 +842,39 @@ OutEndpoint.prototype.transfer = function(buffer, cb){
 	return this;
 }
 
+// Promise-returning variant of transfer; resolves with the number of bytes
+// written
+OutEndpoint.prototype.transferAsync = function(buffer){
+	if (!buffer){
+		buffer = new Buffer(0)
+	}else if (!Buffer.isBuffer(buffer)){
+		buffer = new Buffer(buffer)
+	}
+	var t = pooledTransfer(this, this.device, this.address, this.transferType, this.timeout, RESULT_OUT)
+	return submitPooled(t, buffer)
+}
+
+// Write `buffer`, then read a reply of up to `length` bytes from inEndpoint.
+// The read is submitted natively as soon as the write completes.
+OutEndpoint.prototype.transact = function(buffer, inEndpoint, length, cb){
+	var self = this
+	if (!Buffer.isBuffer(buffer)){
+		buffer = new Buffer(buffer)
+	}
+	var reply = new Buffer(length)
+
+	try {
+		usb._transact(this.device, this.address, this.transferType, buffer, this.timeout,
+			inEndpoint.address, inEndpoint.transferType, reply, inEndpoint.timeout,
+			function(error, buf, actual){
+				cb.call(self, error, reply.slice(0, actual))
+			})
+	} catch (e) {
+		process.nextTick(function() { cb.call(self, e); });
+	}
+	return this;
+}
+
 OutEndpoint.prototype.transferWithZLP = function (buf, cb) {
 	if (buf.length % this.descriptor.wMaxPacketSize == 0) {
 		this.transfer(buf);
@@ -361,6 +884,227 @@ OutEndpoint.prototype.transferWithZLP = function (buf, cb) {
 	}
 }
 
+// Add an InEndpoint to a Poller; returns the index tagging its completions
+usb.Poller.prototype.addEndpoint = function(endpoint, nTransfers, transferSize){
+	return this.add(endpoint.device, endpoint.address, endpoint.transferType,
+		nTransfers || 3, transferSize || endpoint.descriptor.wMaxPacketSize)
+}
+
+var RING_HEADER_SIZE = 16
+var RING_RECORD_HEADER_SIZE = 16
+var RING_WRAP = 0xffffffff
+
+// Consume the records a Poller in ring mode has written to `ring`, calling
+// fn(index, status, timestampUs, ring, offset, length) for each. The data is
+// only valid during the call. Returns the number of records read.
+exports.readRing = function(ring, fn){
+	var capacity = ring.length - RING_HEADER_SIZE
+	var head = ring.readUInt32LE(0)
+	var tail = ring.readUInt32LE(4)
+	var count = 0
+
+	while (tail != head){
+		var pos = RING_HEADER_SIZE + (tail & (capacity - 1))
+		var length = ring.readUInt32LE(pos)
+		if (length == RING_WRAP){
+			tail = (tail + capacity - (pos - RING_HEADER_SIZE)) >>> 0
+			continue
+		}
+		fn(ring.readUInt16LE(pos + 4), ring.readInt16LE(pos + 6),
+			ring.readUInt32LE(pos + 8) + ring.readUInt32LE(pos + 12) * 0x100000000,
+			ring, pos + RING_RECORD_HEADER_SIZE, length)
+		tail = (tail + RING_RECORD_HEADER_SIZE + ((length + 3) & ~3)) >>> 0
+		count++
+	}
+
+	// Hand the space back to the writer
+	ring.writeUInt32LE(tail, 4)
+	return count
+}
+
+// Reconnect: when a device with reconnect enabled re-enumerates on the same
+// port with the same serial number, the new Device takes over the old one's
+// Interface and Endpoint objects and cached config descriptor. The claims and
+// alternate settings in effect are restored natively in one worker hop, and
+// polling restarts with the arguments it was started with.
+
+usb.Device.prototype.enableReconnect = function(callback){
+	var self = this
+	var desc = this.deviceDescriptor
+
+	if (this._reconnect || !desc.iSerialNumber){
+		watch(null)
+	}else{
+		this.getStringDescriptor(desc.iSerialNumber, function(error, serial){
+			if (error){
+				if (callback) callback.call(self, error)
+				return
+			}
+			watch(serial)
+		})
+	}
+
+	// May run in a transfer callback, where a throw would be fatal, so errors
+	// (e.g. no hotplug support, as on Windows) only go to callback
+	function watch(serial){
+		var error
+		if (!self._reconnect){
+			var state = {device: self, serial: serial, restoring: false}
+			try {
+				state.watcher = exports.watchHotplug({vendorId: desc.idVendor, productId: desc.idProduct},
+					function(events){
+						for (var i = 0; i < events.length; i++){
+							if (events[i].type == 'attach'){
+								reconnect(state, events[i].device)
+							}
+						}
+					})
+				self._reconnect = state
+			} catch (e) {
+				error = e
+			}
+		}
+		if (callback) process.nextTick(function(){ callback.call(self, error) })
+	}
+}
+
+usb.Device.prototype.disableReconnect = function(){
+	if (this._reconnect){
+		this._reconnect.watcher.close()
+		this._reconnect = null
+	}
+}
+
+function samePort(a, b){
+	if (a.busNumber != b.busNumber || a.portNumbers.length != b.portNumbers.length) return false
+	for (var i = 0; i < a.portNumbers.length; i++){
+		if (a.portNumbers[i] != b.portNumbers[i]) return false
+	}
+	return true
+}
+
+// Opening the new device can race udev setting up its permissions, so failed
+// restores are retried, backing off from RECONNECT_RETRY_DELAY ms.
+var RECONNECT_RETRIES = 3
+var RECONNECT_RETRY_DELAY = 250
+
+function reconnect(state, device, attempt){
+	var old = state.device
+	if (state.restoring || device === old || !samePort(device, old)) return
+	attempt = attempt || 0
+
+	var interfaces = (old._interfaces || []).filter(function(iface){ return iface })
+	var claimed = interfaces.filter(function(iface){ return iface._claimed })
+	var serial = state.serial === null ? null : new Buffer(state.serial, 'utf16le')
+
+	state.restoring = true
+	device.__restore(serial,
+		claimed.map(function(iface){ return iface.id }),
+		claimed.map(function(iface){ return iface.altSetting }),
+		interfaces.filter(function(iface){ return iface._detached })
+			.map(function(iface){ return iface.id }),
+		function(error){
+			state.restoring = false
+			if (error){
+				// A different device on the same port
+				if (error.errno == usb.LIBUSB_ERROR_NOT_FOUND) return
+				if (attempt < RECONNECT_RETRIES){
+					setTimeout(function(){
+						if (old._reconnect === state){
+							reconnect(state, device, attempt + 1)
+						}
+					}, RECONNECT_RETRY_DELAY << attempt)
+				}else{
+					usb.emit('reconnectError', error, device, old)
+				}
+				return
+			}
+
+			closeWhenDrained(old, device)
+
+			device._configDescriptor = old._configDescriptor
+			if (old.hasOwnProperty('timeout')) device.timeout = old.timeout
+			if (old._maxInflightBytes) device.maxInflightBytes = old._maxInflightBytes
+			if (old._maxQueuedBytes) device.maxQueuedBytes = old._maxQueuedBytes
+
+			device._interfaces = old._interfaces || []
+			device._interfaceList = old._interfaceList
+			device._interfaceIndex = old._interfaceIndex
+			old._interfaces = old._interfaceList = old._interfaceIndex = null
+
+			interfaces.forEach(function(iface){
+				iface.device = device
+				iface._endpoints.forEach(function(ep){
+					if (!ep) return
+					ep.device = device
+					// Pooled transfers are bound to the old device
+					ep._transferPool = null
+					// A released interface's endpoints can't be polled
+					if (ep._pollArgs && iface._claimed) restartPoll(ep)
+				})
+			})
+
+			state.device = device
+			device._reconnect = state
+			old._reconnect = null
+			usb.emit('reconnect', device, old)
+		})
+}
+
+// The old handle belongs to a device that is gone. Its transfers fail on
+// their own, but are cancelled so that the handle can be closed as soon as
+// they have completed.
+function closeWhenDrained(old, device){
+	cancelTransfers(old, null, old, function(){
+		try {
+			old.__close()
+		} catch (e) {
+			// Still held by a Poller
+			usb.emit('reconnectError', e, device, old)
+		}
+	})
+}
+
+function restartPoll(ep){
+	var args = ep._pollArgs
+	function start(){
+		if (ep._pollArgs === args && !ep.pollTransfers){
+			ep.startPoll.apply(ep, args)
+		}
+	}
+	// Wait for the transfers that failed when the device went away
+	if (ep.pollTransfers){
+		ep.once('end', start)
+	}else{
+		start()
+	}
+}
+
+// Subscribe to hotplug events for the devices matching `filter`, delivered in
+// batches to callback(events). Returns an object whose close() unsubscribes.
+exports.watchHotplug = function(filter, callback){
+	if (typeof filter == 'function'){
+		callback = filter
+		filter = {}
+	}
+
+	function match(value){
+		return (value === undefined || value === null) ? usb.LIBUSB_HOTPLUG_MATCH_ANY : value
+	}
+
+	var id = usb._registerHotplug(match(filter.vendorId), match(filter.productId),
+		match(filter.deviceClass), filter.coalesce || 0, !!filter.enumerate, callback)
+
+	return {
+		close: function(){
+			if (id){
+				usb._deregisterHotplug(id)
+				id = null
+			}
+		}
+	}
+}
+
 var hotplugListeners = 0;
 exports.on('newListener', function(name) {
 	if (name !== 'attach' && name !== 'detach') return;